@@ -10,9 +10,8 @@
 // so only 1 shade of gray works.  
 
 // PNG support
-// Includes Grayscale support for 1, 2, 4 and 8 bit
-// Currently we only can support 1 and 2 bit for size
-// And must be created without compression (not enough ram to decompress).
+// Includes Grayscale support for 1, 2, 4 and 8 bit, compressed or not;
+// see the README for the rest
 #include "upng.h"
 
 static Window *gray_window;
@@ -28,35 +27,69 @@ static upng_t* upng = NULL;
     uint8_t bpp;     // supports 1 or 2 bits (bw or gray)
     uint8_t width;   // Max width 144
     uint8_t height;  // Max height 168
-    uint8_t* pixels; // Pixel array
+    uint8_t* pixels; // White bit plane, followed by the gray bit plane
   } image;
 #pragma pack(pop)
 
 
-// Framebuffer width is word aligned, so 160 for 144 wide screen
-#define DRAW_PIXEL( framebuffer, x, y, white ) \
-  framebuffer[((y*160 + x) / 8)] = \
-    ( framebuffer[((y*160 + x) / 8)] \
-    & (0xFF ^ (0x01 << (x%8))) )\
-    | (white << (x%8))
+// Framebuffer width is word aligned, so 160 for 144 wide screen.
+// The bit planes upng decodes to have the same stride and bit order.
+#define FRAMEBUFFER_WORDS (UPNG_PLANE_STRIDE / 4)
+
+// Bytes of image data decoded per slice, small enough to fit between
+// two PWM frames
+#define DECODE_BUDGET 2048
+
+// Set while a decode is running
+static bool decoding = false;
+
+// Reads part of the PNG resource for the decoder, which only keeps a small
+// window of it in memory instead of the whole file
+static unsigned long read_resource(void* user, unsigned long offset,
+    unsigned char* buffer, unsigned long size) {
+  return resource_load_byte_range((ResHandle)user, offset, buffer, size);
+}
 
 static bool load_png_resource(int index) {
   ResHandle rHdl = resource_get_handle(RESOURCE_ID_IMAGE_1 + image_index);
   int png_raw_size = resource_size(rHdl);
-  
+
+  image.pixels = NULL;
+  decoding = false;
   if (upng) {
-    upng_free(upng);
-    upng = NULL;
+    // Keep the decoder and its memory, so switching images does not churn the heap;
+    // a decode still running is given up
+    if (upng_reset_reader(upng, read_resource, rHdl, png_raw_size) != UPNG_EOK) {
+      APP_LOG(APP_LOG_LEVEL_DEBUG, "UPNG reset failed:%d", upng_get_error(upng));
+      return false;
+    }
+  } else {
+    upng = upng_new_from_reader(read_resource, rHdl, png_raw_size);
+    if (!upng) {
+      APP_LOG(APP_LOG_LEVEL_DEBUG, "UPNG: no memory");
+      return false;
+    }
+    upng_set_output(upng, UPNG_OUTPUT_PLANES);
+    upng_set_scale(upng, 144, 168); // Larger images are shrunk to the screen
+    upng_set_levels(upng, UPNG_LEVELS_PERCENTILE); // Stretch 4 and 8 bit images
+    upng_set_background(upng, 255); // Transparent pixels show the white window
   }
-
-  psleep(1); // Avoid watchdog kill
-  
-  uint8_t* png_raw_buffer = malloc(png_raw_size);
-  resource_load(rHdl, png_raw_buffer, png_raw_size);
-  upng = upng_new_from_bytes(png_raw_buffer, png_raw_size);
   APP_LOG(APP_LOG_LEVEL_DEBUG, "UPNG Loaded:%d", upng_get_error(upng));
-  upng_decode(upng);
+  upng_set_arena(upng, 0); // One block for the whole decode, or the heap if it does not fit; grows to the largest image
+  // The decode itself runs a slice at a time from the frame timer
+  decoding = true;
+  return true;
+}
+
+// Decodes the next slice of the PNG load_png_resource started, if there
+// is one, and shows the image once it is done.  Each call returns well
+// before the watchdog would notice.
+static void decode_slice(void) {
+  if (!decoding || upng_decode_step(upng, DECODE_BUDGET) == UPNG_PENDING) {
+    return;
+  }
   APP_LOG(APP_LOG_LEVEL_DEBUG, "UPNG Decode:%d", upng_get_error(upng));
+  decoding = false;
 
   image.pixels = upng_get_buffer(upng);
   image.width = upng_get_width(upng);
@@ -64,8 +97,6 @@ static bool load_png_resource(int index) {
   image.bpp = upng_get_bpp(upng);
   APP_LOG(APP_LOG_LEVEL_DEBUG, "PNG info width:%d height:%d bpp:%d", 
     image.width, image.height, image.bpp);
-
-  psleep(1); // Avoid watchdog kill  
 }
 
 // This draws the gray image buffer struct to the screen framebuffer
@@ -75,38 +106,145 @@ static bool load_png_resource(int index) {
 // as text_layer can be used to draw ontop of the updated framebuffer.
 static void draw_gray(Layer* layer, GContext *ctx) {
   GBitmap* bitmap = (GBitmap*)ctx;
-  uint8_t* framebuffer = (uint8_t*)bitmap->addr;
+  uint32_t* framebuffer = (uint32_t*)bitmap->addr;
   static int pass = 0; // 2 passes for 1 shade of gray with alternate phase
 
+  if (!image.pixels) {
+    return;
+  }
+
+  // The planes are already in framebuffer bit order (LSBit first), so
+  // each pixel is white if set in the white plane, and gray pixels
+  // take their bit from a checkerboard
+  const uint32_t* white = (const uint32_t*)image.pixels;
+  const uint32_t* gray = white + image.height * FRAMEBUFFER_WORDS;
+  int words = (image.width + 31) / 32;
+  uint32_t last_mask = (image.width % 32) ? (1u << (image.width % 32)) - 1 : 0xFFFFFFFF;
+
   for (int y=0; y < image.height; y++) {
-    for (int x=0; x < image.width; x++) {
-      // PNG bit order is LSBit, so need to invert it in each byte
-      // to match framebuffers MSBit for each byte (3 - x%4)
-      uint8_t color = 
-        image.pixels[(y*image.width + x) / 4] >> ((3 - x%4) * 2) & 0x03;
-      if (color == 0x00) { //Black 2 bit
-        DRAW_PIXEL(framebuffer, x, y, 0);
-      } else if (color == 0x03) { //White 2 bit
-        DRAW_PIXEL(framebuffer, x, y, 1);
-      } else { // 1 shade of Gray for both 0x01 and 0x02
-        // using (x%2 + y%2 + pass)%2 allows for 
-        // pixels next to each other in both x and y to alternate on state
-        // entire thing to alternate state each pass (pulse-width-modulation)
-        DRAW_PIXEL(framebuffer, x, y, (x%2 + y%2 + pass)%2);
-      }
+    // using (x%2 + y%2 + pass)%2 allows for
+    // pixels next to each other in both x and y to alternate on state
+    // entire thing to alternate state each pass (pulse-width-modulation)
+    uint32_t phase = ((y + pass) % 2) ? 0x55555555 : 0xAAAAAAAA;
+    uint32_t* row = framebuffer + y * FRAMEBUFFER_WORDS;
+
+    for (int w=0; w < words; w++) {
+      uint32_t mask = (w == words - 1) ? last_mask : 0xFFFFFFFF;
+      uint32_t color = white[w] | (gray[w] & phase);
+      row[w] = (row[w] & ~mask) | (color & mask);
     }
+    white += FRAMEBUFFER_WORDS;
+    gray += FRAMEBUFFER_WORDS;
   }
   pass = (pass+1)%2;
 }
 
 
+#ifdef UPNG_BENCHMARK
+// Decodes the compressed BENCH resources with each inflate backend
+// and logs the average time per decode (build with --benchmark).
+// The decodes run a slice at a time from the frame timer, like the
+// images do, and only the slices are timed.
+#define BENCHMARK_RUNS 5
+#define BENCHMARK_IMAGES 2
+
+static struct {
+  int image;       // BENCH resource being decoded, BENCHMARK_IMAGES once done
+  int backend;
+  int run;
+  uint8_t* buffer; // The resource, loaded for all runs of both backends
+  int size;
+  upng_t* upng;    // The decode in progress
+  int total_ms;
+  upng_error error;
+} bench;
+
+// Decodes the next slice of the benchmark; returns false once it is over.
+static bool benchmark_slice(void) {
+  static const upng_inflater inflaters[] = {
+    UPNG_INFLATER_BUILTIN, UPNG_INFLATER_TINFL };
+  static const char* names[] = { "builtin", "tinfl" };
+
+  if (bench.image >= BENCHMARK_IMAGES) {
+    return false;
+  }
+
+  if (!bench.buffer) {
+    ResHandle rHdl = resource_get_handle(RESOURCE_ID_BENCH_1 + bench.image);
+    bench.size = resource_size(rHdl);
+    bench.buffer = malloc(bench.size);
+    if (!bench.buffer) {
+      APP_LOG(APP_LOG_LEVEL_DEBUG, "BENCH_%d: no memory", bench.image + 1);
+      bench.image++;
+      return true;
+    }
+    resource_load(rHdl, bench.buffer, bench.size);
+  }
+
+  if (!bench.upng) {
+    bench.upng = upng_new_from_bytes(bench.buffer, bench.size);
+    if (!bench.upng) {
+      bench.error = UPNG_ENOMEM;
+    } else {
+      bench.error = upng_set_inflater(bench.upng, inflaters[bench.backend]);
+    }
+  }
+
+  if (bench.error == UPNG_EOK) {
+    time_t start_s, end_s;
+    uint16_t start_ms, end_ms;
+    upng_error error;
+
+    time_ms(&start_s, &start_ms);
+    error = upng_decode_step(bench.upng, DECODE_BUDGET);
+    time_ms(&end_s, &end_ms);
+    bench.total_ms += (end_s - start_s) * 1000 + end_ms - start_ms;
+    if (error == UPNG_PENDING) {
+      return true;
+    }
+    bench.error = error;
+  }
+
+  // One decode is done, or could not start
+  if (bench.upng) {
+    upng_free(bench.upng);
+    bench.upng = NULL;
+  }
+  if (++bench.run < BENCHMARK_RUNS && bench.error == UPNG_EOK) {
+    return true;
+  }
+
+  APP_LOG(APP_LOG_LEVEL_DEBUG, "BENCH_%d %s: %d ms per decode, error:%d",
+    bench.image + 1, names[bench.backend], bench.total_ms / BENCHMARK_RUNS, bench.error);
+  bench.run = 0;
+  bench.total_ms = 0;
+  bench.error = UPNG_EOK;
+  if (++bench.backend == 2) {
+    bench.backend = 0;
+    free(bench.buffer);
+    bench.buffer = NULL;
+    bench.image++;
+  }
+  return true;
+}
+#endif
+
 // Forces window updates by marking the screen dirty
-// which causes a layer redraw callback
+// which causes a layer redraw callback, and decodes
+// a slice of a new image in between
 static void register_timer(void* data) {
   // 20ms == 50fps, anything above shows flicker
   // Always has a little flicker in direct sunlight
   // Causes watchdog timer reset if < 15ms
   app_timer_register(15, register_timer, data);
+#ifdef UPNG_BENCHMARK
+  // The benchmark has the slices to itself until it is over
+  if (benchmark_slice()) {
+    layer_mark_dirty(render_layer);
+    return;
+  }
+#endif
+  decode_slice();
   layer_mark_dirty(render_layer);
 }
 
@@ -10,7 +10,21 @@ typedef unsigned short mz_uint16;
 typedef unsigned int mz_uint32;
 typedef unsigned long long mz_uint64;
 
+// Must match the bit buffer width tinfl.c picks, or the decompressor struct layouts differ.
+#if defined(_WIN64) || defined(__MINGW64__) || defined(_LP64) || defined(__LP64__)
+typedef mz_uint64 tinfl_bit_buf_t;
+#else
 typedef mz_uint32 tinfl_bit_buf_t;
+#endif
+
+// Decompression flags used by tinfl_decompress(), see tinfl.c.
+enum
+{
+  TINFL_FLAG_PARSE_ZLIB_HEADER = 1,
+  TINFL_FLAG_HAS_MORE_INPUT = 2,
+  TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF = 4,
+  TINFL_FLAG_COMPUTE_ADLER32 = 8
+};
 
 // Return status.
 typedef enum
@@ -29,15 +29,26 @@ freely, subject to the following restrictions:
 #include <string.h>
 #include <limits.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
 #pragma GCC push_options
 #pragma GCC optimize ("Os")
 
 #include "upng.h"
 
-//smaller decompressor
-//saves about 900 bytes, but still crashing watch
-//#include "tinfl.h"
-//#define TINFL 1
+//miniz's tinfl as an alternative inflate backend, see the --inflate option in wscript.
+//UPNG_TINFL compiles it in, UPNG_TINFL_ONLY also leaves out the built-in inflater
+#ifdef UPNG_TINFL_ONLY
+#define UPNG_TINFL 1
+#endif
+#ifdef UPNG_TINFL
+#include "tinfl.h"
+#endif
 
 #include <pebble.h>
 
@@ -48,6 +59,7 @@ freely, subject to the following restrictions:
 #define MAKE_DWORD_PTR(p) MAKE_DWORD((p)[0], (p)[1], (p)[2], (p)[3])
 
 #define CHUNK_IHDR MAKE_DWORD('I','H','D','R')
+#define CHUNK_PLTE MAKE_DWORD('P','L','T','E')
 #define CHUNK_IDAT MAKE_DWORD('I','D','A','T')
 #define CHUNK_IEND MAKE_DWORD('I','E','N','D')
 
@@ -57,16 +69,26 @@ freely, subject to the following restrictions:
 #define NUM_DEFLATE_CODE_SYMBOLS 288	/*256 literals, the end code, some length codes, and 2 unused codes */
 #define NUM_DISTANCE_SYMBOLS 32	/*the distance codes have their own symbols, 30 used, 2 unused */
 #define NUM_CODE_LENGTH_CODES 19	/*the code length codes. 0-15: code lengths, 16: copy previous 3-6 times, 17: 3-10 zeros, 18: 11-138 zeros */
-#define MAX_SYMBOLS 288 /* largest number of symbols used by any tree type */
-
-#define DEFLATE_CODE_BITLEN 15
-#define DISTANCE_BITLEN 15
-#define CODE_LENGTH_BITLEN 7
 #define MAX_BIT_LENGTH 15 /* largest bitlen used by any tree type */
 
-#define DEFLATE_CODE_BUFFER_SIZE (NUM_DEFLATE_CODE_SYMBOLS * 2)
-#define DISTANCE_BUFFER_SIZE (NUM_DISTANCE_SYMBOLS * 2)
-#define CODE_LENGTH_BUFFER_SIZE (NUM_DISTANCE_SYMBOLS * 2)
+/* codes are decoded by looking up their first bits in a table; codes longer than that continue in a subtable.
+   the sizes are the worst case for the number of symbols and the root bits, as computed by zlib's enough.c */
+#define DEFLATE_CODE_ROOT_BITS 9
+#define DEFLATE_CODE_TABLE_SIZE 852
+#define DISTANCE_ROOT_BITS 6
+#define DISTANCE_TABLE_SIZE 592
+#define CODE_LENGTH_ROOT_BITS 7
+#define CODE_LENGTH_TABLE_SIZE 128
+#define FIXED_CODE_ROOT_BITS 9	/* the fixed codes are no longer than this, so their tables have no subtables */
+#define FIXED_DISTANCE_ROOT_BITS 5
+
+/* a table entry is either (code length << 9) | symbol, or a link to a subtable, HUFFMAN_LINK | (subtable index bits << 10) | subtable offset.
+   entries that belong to no code of an incomplete code are 0 */
+#define HUFFMAN_LINK 0x8000
+#define HUFFMAN_SYMBOL(e) ((e) & 0x1FF)
+#define HUFFMAN_LENGTH(e) (((e) >> 9) & 0xF)
+#define HUFFMAN_SUB_OFFSET(e) ((e) & 0x3FF)
+#define HUFFMAN_SUB_BITS(e) (((e) >> 10) & 0x7)
 
 #define SET_ERROR(upng,code) do { (upng)->error = (code); (upng)->error_line = __LINE__; } while (0)
 
@@ -78,22 +100,43 @@ typedef enum upng_state {
 	UPNG_ERROR		= -1,
 	UPNG_DECODED	= 0,
 	UPNG_HEADER		= 1,
-	UPNG_NEW		= 2
+	UPNG_NEW		= 2,
+	UPNG_DECODING	= 3		/* upng_decode_step is in the middle of the image */
 } upng_state;
 
 typedef enum upng_color {
 	UPNG_LUM		= 0,
 	UPNG_RGB		= 2,
+	UPNG_PLT		= 3,
 	UPNG_LUMA		= 4,
 	UPNG_RGBA		= 6
 } upng_color;
 
+/* PNGs that are not in memory as a whole are read a window of this many bytes at a time, see upng_new_from_reader */
+#ifndef UPNG_READ_WINDOW
+#define UPNG_READ_WINDOW 512
+#endif
+
 typedef struct upng_source {
 	const unsigned char*	buffer;
 	unsigned long			size;
 	char					owning;
+	upng_read_callback		read;		/* when set, the PNG is read into window as it is needed instead of being in buffer */
+	void*					user;
+	unsigned char*			window;		/* UPNG_READ_WINDOW bytes, allocated with the first reader and kept with the decoder */
+	unsigned long			window_offset;	/* of the first byte in window */
+	unsigned long			window_fill;	/* bytes in window */
 } upng_source;
 
+/* IDAT chunks are indexed while the chunk list is checked, so the image data can be read without walking it again;
+   images with more IDAT chunks than fit walk on from the last one indexed */
+#define UPNG_IDAT_INDEX 16
+
+typedef struct upng_chunk_span {
+	unsigned long	offset;		/* of the chunk in the source */
+	unsigned long	length;		/* of its payload */
+} upng_chunk_span;
+
 struct upng_t {
 	unsigned		width;
 	unsigned		height;
@@ -104,19 +147,176 @@ struct upng_t {
 
 	unsigned char*	buffer;
 	unsigned long	size;
+	unsigned long	capacity;	/* bytes allocated for buffer, which upng_reset keeps for the next image */
 
 	upng_error		error;
 	unsigned		error_line;
 
 	upng_state		state;
 	upng_source		source;
+
+	upng_chunk_span	idat[UPNG_IDAT_INDEX];	/* the first IDAT chunks */
+	unsigned		idat_count;	/* IDAT chunks in the image, indexed or not */
+
+	upng_inflater	inflater;
+	upng_verify		verify;
+	unsigned*		crc_table;	/* slice by 4 CRC table while decoding with UPNG_VERIFY_FULL */
+	upng_output		output;
+	upng_dither		dither;
+	unsigned		interlace;
+	int				in_place;	/* see upng_set_in_place */
+
+	unsigned char*	palette;	/* for indexed images: each byte of indices to the same byte of gray levels */
+
+	unsigned		scale_width;	/* bounds set with upng_set_scale, 0 when not scaling */
+	unsigned		scale_height;
+
+	int				background;	/* luma alpha is composited against, -1 to keep the alpha channel */
+
+	upng_levels		levels;
+	unsigned		cut_gray;	/* cut points the last decode used, see upng_get_cuts */
+	unsigned		cut_white;
+
+	upng_allocator	allocator;
+	unsigned char*	arena;		/* block all memory for decoding comes from, see upng_set_arena */
+	unsigned long	arena_size;
+	unsigned long	arena_used;
+	unsigned long	arena_last;	/* offset of the last allocation, which can be given back before the others */
+	unsigned		arena_live;	/* allocations not given back yet; once there are none the arena starts over */
+
+	struct upng_step*	step;	/* the decode upng_decode_step is in the middle of */
 };
 
-#ifndef TINFL
+/* allocations from the arena are aligned for any of the decoder's own structures */
+#define UPNG_ARENA_ALIGN 8
+
+static unsigned long upng_arena_round(unsigned long size)
+{
+	return (size + UPNG_ARENA_ALIGN - 1) & ~(unsigned long)(UPNG_ARENA_ALIGN - 1);
+}
+
+static void* upng_heap_alloc(void* user, unsigned long size)
+{
+	return malloc(size);
+}
+
+static void upng_heap_free(void* user, void* ptr)
+{
+	free(ptr);
+}
+
+/* all memory for decoding comes from here: from the arena if there is one, otherwise from the allocator */
+static void* upng_alloc(upng_t* upng, unsigned long size)
+{
+	void* ptr;
+
+	if (upng->arena == NULL) {
+		return upng->allocator.alloc(upng->allocator.user, size);
+	}
+
+	size = upng_arena_round(size);
+	if (size > upng->arena_size - upng->arena_used) {
+		return NULL;
+	}
+
+	ptr = upng->arena + upng->arena_used;
+	upng->arena_last = upng->arena_used;
+	upng->arena_used += size;
+	upng->arena_live++;
+	return ptr;
+}
+
+static void* upng_calloc(upng_t* upng, unsigned long count, unsigned long size)
+{
+	void* ptr = upng_alloc(upng, count * size);
+
+	if (ptr != NULL) {
+		memset(ptr, 0, count * size);
+	}
+	return ptr;
+}
+
+static void upng_dealloc(upng_t* upng, void* ptr)
+{
+	if (ptr == NULL) {
+		return;
+	}
+
+	if (upng->arena == NULL) {
+		if (upng->allocator.free != NULL) {
+			upng->allocator.free(upng->allocator.user, ptr);
+		}
+		return;
+	}
+
+	/* arena memory is only reused once all of it was given back, or right away for the last allocation */
+	if (--upng->arena_live == 0) {
+		upng->arena_used = 0;
+	} else if ((unsigned char*)ptr == upng->arena + upng->arena_last) {
+		upng->arena_used = upng->arena_last;
+	}
+}
+
+/* give back the end of an allocation that is larger than it has to be, where that can be done; return value is the
+   allocation, which realloc may have moved */
+static void* upng_shrink(upng_t* upng, void* ptr, unsigned long size)
+{
+	if (upng->arena != NULL) {
+		if ((unsigned char*)ptr == upng->arena + upng->arena_last) {
+			upng->arena_used = upng->arena_last + upng_arena_round(size);
+		}
+	} else if (upng->allocator.alloc == upng_heap_alloc && size > 0) {
+		void* smaller = realloc(ptr, size);
+		if (smaller != NULL) {
+			return smaller;
+		}
+	}
+
+	return ptr;
+}
+
+/* size bytes of the PNG from offset on, read into the window unless they are in it already when the PNG is read a
+   window at a time, in which case size must not be more than UPNG_READ_WINDOW. return value is NULL if the PNG ends
+   before, or cannot be read */
+static const unsigned char* upng_source_at(upng_source* source, unsigned long offset, unsigned long size)
+{
+	unsigned long n;
+
+	if (offset > source->size || size > source->size - offset) {
+		return NULL;
+	}
+
+	if (source->read == NULL) {
+		return source->buffer + offset;
+	}
+
+	if (offset < source->window_offset || offset + size > source->window_offset + source->window_fill) {
+		n = source->size - offset < UPNG_READ_WINDOW ? source->size - offset : UPNG_READ_WINDOW;
+		source->window_offset = offset;
+		source->window_fill = source->read(source->user, offset, source->window, n);
+		if (source->window_fill > n) {
+			source->window_fill = n;
+		}
+		if (source->window_fill < size) {
+			source->window_fill = 0;
+			return NULL;
+		}
+	}
+
+	return source->window + (offset - source->window_offset);
+}
+
+/* the most of size bytes upng_source_at can give at once */
+static unsigned long upng_source_piece(const upng_source* source, unsigned long size)
+{
+	return source->read != NULL && size > UPNG_READ_WINDOW ? UPNG_READ_WINDOW : size;
+}
+
+#ifndef UPNG_TINFL_ONLY
 typedef struct huffman_tree {
-	unsigned* tree2d;
-	unsigned maxbitlen;	/*maximum number of bits a single code can get */
-	unsigned numcodes;	/*number of symbols in the alphabet = number of codes */
+	const unsigned short* table;
+	unsigned rootbits;	/*number of bits looked up at once in the first level of the table */
+	unsigned size;	/*number of entries in table, first level and subtables together */
 } huffman_tree;
 
 static const unsigned LENGTH_BASE[29] = {	/*the base lengths represented by codes 257-285 */
@@ -142,878 +342,3512 @@ static const unsigned DISTANCE_EXTRA[30] = {	/*the extra bits of backwards dista
 static const unsigned CLCL[NUM_CODE_LENGTH_CODES]	/*the order in which "code length alphabet code lengths" are stored, out of this the huffman tree of the dynamic huffman tree lengths is generated */
 = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
 
-static const unsigned FIXED_DEFLATE_CODE_TREE[NUM_DEFLATE_CODE_SYMBOLS * 2] = {
-	289, 370, 290, 307, 546, 291, 561, 292, 293, 300, 294, 297, 295, 296, 0, 1,
-	2, 3, 298, 299, 4, 5, 6, 7, 301, 304, 302, 303, 8, 9, 10, 11, 305, 306, 12,
-	13, 14, 15, 308, 339, 309, 324, 310, 317, 311, 314, 312, 313, 16, 17, 18,
-	19, 315, 316, 20, 21, 22, 23, 318, 321, 319, 320, 24, 25, 26, 27, 322, 323,
-	28, 29, 30, 31, 325, 332, 326, 329, 327, 328, 32, 33, 34, 35, 330, 331, 36,
-	37, 38, 39, 333, 336, 334, 335, 40, 41, 42, 43, 337, 338, 44, 45, 46, 47,
-	340, 355, 341, 348, 342, 345, 343, 344, 48, 49, 50, 51, 346, 347, 52, 53,
-	54, 55, 349, 352, 350, 351, 56, 57, 58, 59, 353, 354, 60, 61, 62, 63, 356,
-	363, 357, 360, 358, 359, 64, 65, 66, 67, 361, 362, 68, 69, 70, 71, 364,
-	367, 365, 366, 72, 73, 74, 75, 368, 369, 76, 77, 78, 79, 371, 434, 372,
-	403, 373, 388, 374, 381, 375, 378, 376, 377, 80, 81, 82, 83, 379, 380, 84,
-	85, 86, 87, 382, 385, 383, 384, 88, 89, 90, 91, 386, 387, 92, 93, 94, 95,
-	389, 396, 390, 393, 391, 392, 96, 97, 98, 99, 394, 395, 100, 101, 102, 103,
-	397, 400, 398, 399, 104, 105, 106, 107, 401, 402, 108, 109, 110, 111, 404,
-	419, 405, 412, 406, 409, 407, 408, 112, 113, 114, 115, 410, 411, 116, 117,
-	118, 119, 413, 416, 414, 415, 120, 121, 122, 123, 417, 418, 124, 125, 126,
-	127, 420, 427, 421, 424, 422, 423, 128, 129, 130, 131, 425, 426, 132, 133,
-	134, 135, 428, 431, 429, 430, 136, 137, 138, 139, 432, 433, 140, 141, 142,
-	143, 435, 483, 436, 452, 568, 437, 438, 445, 439, 442, 440, 441, 144, 145,
-	146, 147, 443, 444, 148, 149, 150, 151, 446, 449, 447, 448, 152, 153, 154,
-	155, 450, 451, 156, 157, 158, 159, 453, 468, 454, 461, 455, 458, 456, 457,
-	160, 161, 162, 163, 459, 460, 164, 165, 166, 167, 462, 465, 463, 464, 168,
-	169, 170, 171, 466, 467, 172, 173, 174, 175, 469, 476, 470, 473, 471, 472,
-	176, 177, 178, 179, 474, 475, 180, 181, 182, 183, 477, 480, 478, 479, 184,
-	185, 186, 187, 481, 482, 188, 189, 190, 191, 484, 515, 485, 500, 486, 493,
-	487, 490, 488, 489, 192, 193, 194, 195, 491, 492, 196, 197, 198, 199, 494,
-	497, 495, 496, 200, 201, 202, 203, 498, 499, 204, 205, 206, 207, 501, 508,
-	502, 505, 503, 504, 208, 209, 210, 211, 506, 507, 212, 213, 214, 215, 509,
-	512, 510, 511, 216, 217, 218, 219, 513, 514, 220, 221, 222, 223, 516, 531,
-	517, 524, 518, 521, 519, 520, 224, 225, 226, 227, 522, 523, 228, 229, 230,
-	231, 525, 528, 526, 527, 232, 233, 234, 235, 529, 530, 236, 237, 238, 239,
-	532, 539, 533, 536, 534, 535, 240, 241, 242, 243, 537, 538, 244, 245, 246,
-	247, 540, 543, 541, 542, 248, 249, 250, 251, 544, 545, 252, 253, 254, 255,
-	547, 554, 548, 551, 549, 550, 256, 257, 258, 259, 552, 553, 260, 261, 262,
-	263, 555, 558, 556, 557, 264, 265, 266, 267, 559, 560, 268, 269, 270, 271,
-	562, 565, 563, 564, 272, 273, 274, 275, 566, 567, 276, 277, 278, 279, 569,
-	572, 570, 571, 280, 281, 282, 283, 573, 574, 284, 285, 286, 287, 0, 0
+/* the tables of the fixed trees, for the code lengths given in the deflate spec: literals 0-143 have 8 bits, 144-255 9,
+   256-279 7 and 280-287 8; the distances all have 5 */
+static const unsigned short FIXED_CODE_TABLE[1 << FIXED_CODE_ROOT_BITS] = {
+	3840, 4176, 4112, 4376, 3856, 4208, 4144, 4800, 3848, 4192, 4128, 4768, 4096, 4224, 4160, 4832,
+	3844, 4184, 4120, 4752, 3860, 4216, 4152, 4816, 3852, 4200, 4136, 4784, 4104, 4232, 4168, 4848,
+	3842, 4180, 4116, 4380, 3858, 4212, 4148, 4808, 3850, 4196, 4132, 4776, 4100, 4228, 4164, 4840,
+	3846, 4188, 4124, 4760, 3862, 4220, 4156, 4824, 3854, 4204, 4140, 4792, 4108, 4236, 4172, 4856,
+	3841, 4178, 4114, 4378, 3857, 4210, 4146, 4804, 3849, 4194, 4130, 4772, 4098, 4226, 4162, 4836,
+	3845, 4186, 4122, 4756, 3861, 4218, 4154, 4820, 3853, 4202, 4138, 4788, 4106, 4234, 4170, 4852,
+	3843, 4182, 4118, 4382, 3859, 4214, 4150, 4812, 3851, 4198, 4134, 4780, 4102, 4230, 4166, 4844,
+	3847, 4190, 4126, 4764, 3863, 4222, 4158, 4828, 3855, 4206, 4142, 4796, 4110, 4238, 4174, 4860,
+	3840, 4177, 4113, 4377, 3856, 4209, 4145, 4802, 3848, 4193, 4129, 4770, 4097, 4225, 4161, 4834,
+	3844, 4185, 4121, 4754, 3860, 4217, 4153, 4818, 3852, 4201, 4137, 4786, 4105, 4233, 4169, 4850,
+	3842, 4181, 4117, 4381, 3858, 4213, 4149, 4810, 3850, 4197, 4133, 4778, 4101, 4229, 4165, 4842,
+	3846, 4189, 4125, 4762, 3862, 4221, 4157, 4826, 3854, 4205, 4141, 4794, 4109, 4237, 4173, 4858,
+	3841, 4179, 4115, 4379, 3857, 4211, 4147, 4806, 3849, 4195, 4131, 4774, 4099, 4227, 4163, 4838,
+	3845, 4187, 4123, 4758, 3861, 4219, 4155, 4822, 3853, 4203, 4139, 4790, 4107, 4235, 4171, 4854,
+	3843, 4183, 4119, 4383, 3859, 4215, 4151, 4814, 3851, 4199, 4135, 4782, 4103, 4231, 4167, 4846,
+	3847, 4191, 4127, 4766, 3863, 4223, 4159, 4830, 3855, 4207, 4143, 4798, 4111, 4239, 4175, 4862,
+	3840, 4176, 4112, 4376, 3856, 4208, 4144, 4801, 3848, 4192, 4128, 4769, 4096, 4224, 4160, 4833,
+	3844, 4184, 4120, 4753, 3860, 4216, 4152, 4817, 3852, 4200, 4136, 4785, 4104, 4232, 4168, 4849,
+	3842, 4180, 4116, 4380, 3858, 4212, 4148, 4809, 3850, 4196, 4132, 4777, 4100, 4228, 4164, 4841,
+	3846, 4188, 4124, 4761, 3862, 4220, 4156, 4825, 3854, 4204, 4140, 4793, 4108, 4236, 4172, 4857,
+	3841, 4178, 4114, 4378, 3857, 4210, 4146, 4805, 3849, 4194, 4130, 4773, 4098, 4226, 4162, 4837,
+	3845, 4186, 4122, 4757, 3861, 4218, 4154, 4821, 3853, 4202, 4138, 4789, 4106, 4234, 4170, 4853,
+	3843, 4182, 4118, 4382, 3859, 4214, 4150, 4813, 3851, 4198, 4134, 4781, 4102, 4230, 4166, 4845,
+	3847, 4190, 4126, 4765, 3863, 4222, 4158, 4829, 3855, 4206, 4142, 4797, 4110, 4238, 4174, 4861,
+	3840, 4177, 4113, 4377, 3856, 4209, 4145, 4803, 3848, 4193, 4129, 4771, 4097, 4225, 4161, 4835,
+	3844, 4185, 4121, 4755, 3860, 4217, 4153, 4819, 3852, 4201, 4137, 4787, 4105, 4233, 4169, 4851,
+	3842, 4181, 4117, 4381, 3858, 4213, 4149, 4811, 3850, 4197, 4133, 4779, 4101, 4229, 4165, 4843,
+	3846, 4189, 4125, 4763, 3862, 4221, 4157, 4827, 3854, 4205, 4141, 4795, 4109, 4237, 4173, 4859,
+	3841, 4179, 4115, 4379, 3857, 4211, 4147, 4807, 3849, 4195, 4131, 4775, 4099, 4227, 4163, 4839,
+	3845, 4187, 4123, 4759, 3861, 4219, 4155, 4823, 3853, 4203, 4139, 4791, 4107, 4235, 4171, 4855,
+	3843, 4183, 4119, 4383, 3859, 4215, 4151, 4815, 3851, 4199, 4135, 4783, 4103, 4231, 4167, 4847,
+	3847, 4191, 4127, 4767, 3863, 4223, 4159, 4831, 3855, 4207, 4143, 4799, 4111, 4239, 4175, 4863
 };
 
-static const unsigned FIXED_DISTANCE_TREE[NUM_DISTANCE_SYMBOLS * 2] = {
-	33, 48, 34, 41, 35, 38, 36, 37, 0, 1, 2, 3, 39, 40, 4, 5, 6, 7, 42, 45, 43,
-	44, 8, 9, 10, 11, 46, 47, 12, 13, 14, 15, 49, 56, 50, 53, 51, 52, 16, 17,
-	18, 19, 54, 55, 20, 21, 22, 23, 57, 60, 58, 59, 24, 25, 26, 27, 61, 62, 28,
-	29, 30, 31, 0, 0
+static const unsigned short FIXED_DISTANCE_TABLE[1 << FIXED_DISTANCE_ROOT_BITS] = {
+	2560, 2576, 2568, 2584, 2564, 2580, 2572, 2588, 2562, 2578, 2570, 2586, 2566, 2582, 2574, 2590,
+	2561, 2577, 2569, 2585, 2565, 2581, 2573, 2589, 2563, 2579, 2571, 2587, 2567, 2583, 2575, 2591
 };
+
+/* the tables of the dynamic trees, far too big for the stack. the code length tree is only needed while the code
+   lengths of the other two are read, before the distance table is made, so it is kept at the start of that */
+typedef struct uz_trees {
+	unsigned short code[DEFLATE_CODE_TABLE_SIZE];
+	unsigned short distance[DISTANCE_TABLE_SIZE];
+	unsigned char lengths[NUM_DEFLATE_CODE_SYMBOLS + NUM_DISTANCE_SYMBOLS];	/* of the literal/length codes, then of the distance codes */
+} uz_trees;
 #endif
 
-static unsigned char read_bit(unsigned long *bitpointer, const unsigned char *bitstream)
+/* CRC-32 of chunks, slice by 4: table k holds the CRC of each byte followed by k zero bytes, so a word of data takes
+   four lookups. the table is built only while decoding with UPNG_VERIFY_FULL, 4k of heap is too much to keep around */
+static unsigned* upng_crc_table_create(upng_t* upng)
 {
-	unsigned char result = (unsigned char)((bitstream[(*bitpointer) >> 3] >> ((*bitpointer) & 0x7)) & 1);
-	(*bitpointer)++;
-	return result;
-}
+	unsigned* table = (unsigned*)upng_alloc(upng, 4 * 256 * sizeof(unsigned));
+	unsigned i, k;
 
-#ifndef TINFL
-static unsigned read_bits(unsigned long *bitpointer, const unsigned char *bitstream, unsigned long nbits)
-{
-	unsigned result = 0, i;
-	for (i = 0; i < nbits; i++)
-		result |= ((unsigned)read_bit(bitpointer, bitstream)) << i;
-	return result;
+	if (table == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < 256; i++) {
+		unsigned c = i;
+		for (k = 0; k < 8; k++) {
+			c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		}
+		table[i] = c;
+	}
+	for (i = 256; i < 4 * 256; i++) {
+		table[i] = (table[i - 256] >> 8) ^ table[table[i - 256] & 255];
+	}
+
+	return table;
 }
 
-/* the buffer must be numcodes*2 in size! */
-static void huffman_tree_init(huffman_tree* tree, unsigned* buffer, unsigned numcodes, unsigned maxbitlen)
+/* carry crc on over length more bytes; a CRC starts out as 0xFFFFFFFF and ends inverted */
+static unsigned upng_crc32(const unsigned* table, unsigned crc, const unsigned char* data, unsigned long length)
 {
-	tree->tree2d = buffer;
+	for (; length >= 4; length -= 4, data += 4) {
+		crc ^= data[0] | (unsigned)data[1] << 8 | (unsigned)data[2] << 16 | (unsigned)data[3] << 24;
+		crc = table[768 + (crc & 255)] ^ table[512 + ((crc >> 8) & 255)] ^ table[256 + ((crc >> 16) & 255)] ^ table[crc >> 24];
+	}
+	for (; length > 0; length--) {
+		crc = table[(crc ^ *data++) & 255] ^ (crc >> 8);
+	}
 
-	tree->numcodes = numcodes;
-	tree->maxbitlen = maxbitlen;
+	return crc;
 }
 
-/*given the code lengths (as stored in the PNG file), generate the tree as defined by Deflate. maxbitlen is the maximum bits that a code in the tree can have. return value is error.*/
-static void huffman_tree_create_lengths(upng_t* upng, huffman_tree* tree, const unsigned *bitlen)
+/* nonzero if the CRC at the end of the chunk at offset matches its type and data, which are read a piece at a time
+   when the PNG is read a window at a time */
+static int upng_chunk_crc_ok(upng_source* source, const unsigned* table, unsigned long chunk)
 {
-	unsigned tree1d[MAX_SYMBOLS];
-	unsigned blcount[MAX_BIT_LENGTH];
-	unsigned nextcode[MAX_BIT_LENGTH];
-	unsigned bits, n, i;
-	unsigned nodefilled = 0;	/*up to which node it is filled */
-	unsigned treepos = 0;	/*position in the tree (1 of the numcodes columns) */
-
-	/* initialize local vectors */
-	memset(blcount, 0, sizeof(blcount));
-	memset(nextcode, 0, sizeof(nextcode));
+	const unsigned char* data = upng_source_at(source, chunk, 8);
+	unsigned crc = 0xFFFFFFFFu;
+	unsigned long offset, left;
 
-	/*step 1: count number of instances of each code length */
-	for (bits = 0; bits < tree->numcodes; bits++) {
-		blcount[bitlen[bits]]++;
+	if (data == NULL) {
+		return 0;
 	}
 
-	/*step 2: generate the nextcode values */
-	for (bits = 1; bits <= tree->maxbitlen; bits++) {
-		nextcode[bits] = (nextcode[bits - 1] + blcount[bits - 1]) << 1;
-	}
+	offset = chunk + 4;
+	left = upng_chunk_length(data) + 4;
+	while (left > 0) {
+		unsigned long n = upng_source_piece(source, left);
 
-	/*step 3: generate all the codes */
-	for (n = 0; n < tree->numcodes; n++) {
-		if (bitlen[n] != 0) {
-			tree1d[n] = nextcode[bitlen[n]]++;
+		data = upng_source_at(source, offset, n);
+		if (data == NULL) {
+			return 0;
 		}
+		crc = upng_crc32(table, crc, data, n);
+		offset += n;
+		left -= n;
 	}
 
-	/*convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means uninited, a value >= numcodes is an address to another bit, a value < numcodes is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as many columns as codes - 1
-	   a good huffmann tree has N * 2 - 1 nodes, of which N - 1 are internal nodes. Here, the internal nodes are stored (what their 0 and 1 option point to). There is only memory for such good tree currently, if there are more nodes (due to too long length codes), error 55 will happen */
-	for (n = 0; n < tree->numcodes * 2; n++) {
-		tree->tree2d[n] = 32767;	/*32767 here means the tree2d isn't filled there yet */
-	}
+	data = upng_source_at(source, offset, 4);
+	return data != NULL && ~crc == ((unsigned)data[0] << 24 | (unsigned)data[1] << 16 | (unsigned)data[2] << 8 | data[3]);
+}
 
-	for (n = 0; n < tree->numcodes; n++) {	/*the codes */
-		for (i = 0; i < bitlen[n]; i++) {	/*the bits for this code */
-			unsigned char bit = (unsigned char)((tree1d[n] >> (bitlen[n] - i - 1)) & 1);
-			/* check if oversubscribed */
-			if (treepos > tree->numcodes - 2) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				return;
-			}
+/* Adler-32 of the inflated data, ADLER_NMAX bytes at a time: the most that can be added up before the sums have to be
+   reduced to fit in 32 bits. the host adds up 16 bytes at a time with SSE2 */
+#define ADLER_BASE 65521
+#define ADLER_NMAX 5552
 
-			if (tree->tree2d[2 * treepos + bit] == 32767) {	/*not yet filled in */
-				if (i + 1 == bitlen[n]) {	/*last bit */
-					tree->tree2d[2 * treepos + bit] = n;	/*put the current code in it */
-					treepos = 0;
-				} else {	/*put address of the next step in here, first that address has to be found of course (it's just nodefilled + 1)... */
-					nodefilled++;
-					tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;	/*addresses encoded with numcodes added to it */
-					treepos = nodefilled;
-				}
-			} else {
-				treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
+#if defined(__SSE2__)
+static unsigned long uz_adler32_hsum(__m128i v)
+{
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (unsigned)_mm_cvtsi128_si32(v);
+}
+#endif
+
+static unsigned long uz_adler32(unsigned long adler, const unsigned char* data, unsigned long length)
+{
+	unsigned long s1 = adler & 0xFFFF, s2 = (adler >> 16) & 0xFFFF;
+
+	while (length > 0) {
+		unsigned long n = length < ADLER_NMAX ? length : ADLER_NMAX;
+		length -= n;
+
+#if defined(__SSE2__)
+		/* every 16 bytes add their sum to s1, and to s2 16 times s1 before them plus the bytes weighted 16 down to 1 */
+		if (n >= 16) {
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i weights_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+			const __m128i weights_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+			__m128i sum1 = zero, sums1 = zero, sum2 = zero;
+			unsigned long blocks = n / 16, b;
+
+			for (b = 0; b < blocks; b++, data += 16) {
+				__m128i x = _mm_loadu_si128((const __m128i*)data);
+				sums1 = _mm_add_epi32(sums1, sum1);
+				sum1 = _mm_add_epi32(sum1, _mm_sad_epu8(x, zero));
+				sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(_mm_unpacklo_epi8(x, zero), weights_lo));
+				sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), weights_hi));
 			}
+
+			s2 = (unsigned long)((s2 + 16ULL * blocks * s1 + 16ULL * uz_adler32_hsum(sums1) + uz_adler32_hsum(sum2)) % ADLER_BASE);
+			s1 += uz_adler32_hsum(sum1);
+			n -= blocks * 16;
 		}
-	}
+#endif
 
-	for (n = 0; n < tree->numcodes * 2; n++) {
-		if (tree->tree2d[n] == 32767) {
-			tree->tree2d[n] = 0;	/*remove possible remaining 32767's */
+		for (; n >= 8; n -= 8, data += 8) {
+			s1 += data[0]; s2 += s1; s1 += data[1]; s2 += s1;
+			s1 += data[2]; s2 += s1; s1 += data[3]; s2 += s1;
+			s1 += data[4]; s2 += s1; s1 += data[5]; s2 += s1;
+			s1 += data[6]; s2 += s1; s1 += data[7]; s2 += s1;
 		}
+		for (; n > 0; n--) {
+			s1 += *data++;
+			s2 += s1;
+		}
+
+		s1 %= ADLER_BASE;
+		s2 %= ADLER_BASE;
 	}
+
+	return s2 << 16 | s1;
 }
 
-static unsigned huffman_decode_symbol(upng_t *upng, const unsigned char *in, unsigned long *bp, const huffman_tree* codetree, unsigned long inlength)
+/* the bit buffer is refilled a whole word at a time, 64 bits on 64-bit hosts and 32 on the watch */
+#if defined(__LP64__) || defined(_WIN64)
+typedef unsigned long long uz_bitbuf;
+#else
+typedef unsigned long uz_bitbuf;
+#endif
+#define UZ_BITBUF_BITS (sizeof(uz_bitbuf) * 8)
+
+/* the zlib stream is read in place from the IDAT chunks of the source buffer, or a window at a time from a PNG that
+   is read that way; when the payload of one IDAT chunk runs out, reading simply continues in the next one */
+typedef struct uz_stream {
+	upng_source*			source;
+	unsigned long			chunk;		/* offset of the IDAT chunk currently being read */
+	unsigned long			length;		/* of its payload */
+	unsigned long			rest;		/* bytes of the payload after limit, still to be read */
+	const upng_chunk_span*	index;		/* next IDAT chunk in the index */
+	unsigned				indexed;	/* entries left in the index */
+	unsigned				remaining;	/* IDAT chunks after the current one, indexed or not */
+	const unsigned char*	next;		/* next unread byte of the current payload */
+	const unsigned char*	limit;		/* end of the current payload, or of the part of it in the window */
+	uz_bitbuf				bitbuf;		/* bits fetched but not consumed yet, lsb first */
+	unsigned				bitcount;	/* number of valid bits in bitbuf */
+	unsigned				overrun;	/* zero bytes put into bitbuf after the end of the data */
+	const unsigned*			crc_table;	/* when set, the CRC of each IDAT chunk is checked as the stream enters it */
+	int						corrupt;	/* an IDAT chunk failed its CRC, the stream ends before it */
+} uz_stream;
+
+/* move on to the rest of the current payload, or to the payload of the next IDAT chunk; return value is 0 if there
+   is none */
+static int uz_stream_next_chunk(uz_stream* s)
 {
-	unsigned treepos = 0, ct;
-	unsigned char bit;
-	for (;;) {
-		/* error: end of input memory reached without endcode */
-		if (((*bp) & 0x07) == 0 && ((*bp) >> 3) > inlength) {
-			SET_ERROR(upng, UPNG_EMALFORMED);
+	const unsigned char* header;
+	unsigned long chunk, n;
+
+	if (s->rest == 0) {
+		if (s->corrupt || s->remaining == 0) {
 			return 0;
 		}
 
-		bit = read_bit(bp, in);
+		if (s->indexed > 0) {
+			chunk = s->index->offset;
+			s->index++;
+			s->indexed--;
+		} else {
+			/* past the end of the index: the next IDAT chunk is further down the (already checked) chunk list */
+			chunk = s->chunk + s->length + 12;
+			while ((header = upng_source_at(s->source, chunk, 8)) != NULL && upng_chunk_type(header) != CHUNK_IDAT) {
+				chunk += upng_chunk_length(header) + 12;
+			}
+		}
+		s->remaining--;
 
-		ct = codetree->tree2d[(treepos << 1) | bit];
-		if (ct < codetree->numcodes) {
-			return ct;
+		if (s->crc_table != NULL && !upng_chunk_crc_ok(s->source, s->crc_table, chunk)) {
+			s->corrupt = 1;
+			return 0;
 		}
 
-		treepos = ct - codetree->numcodes;
-		if (treepos >= codetree->numcodes) {
-			SET_ERROR(upng, UPNG_EMALFORMED);
+		header = upng_source_at(s->source, chunk, 8);
+		if (header == NULL) {
 			return 0;
 		}
+		s->chunk = chunk;
+		s->length = s->rest = upng_chunk_length(header);
 	}
+
+	n = upng_source_piece(s->source, s->rest);
+	s->next = upng_source_at(s->source, s->chunk + 8 + s->length - s->rest, n);
+	if (s->next == NULL) {
+		s->limit = NULL;
+		return 0;
+	}
+	s->limit = s->next + n;
+	s->rest -= n;
+	return 1;
 }
 
-/* get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
-static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffman_tree* codetreeD, huffman_tree* codelengthcodetree, const unsigned char *in, unsigned long *bp, unsigned long inlength)
+/* position the stream at the start of the payload of the first IDAT chunk of the index upng_index_chunks built.
+   with a CRC table, a later IDAT chunk that fails its CRC ends the stream as if there were no more image data */
+static void uz_stream_init(uz_stream* s, upng_t* upng)
 {
-	unsigned codelengthcode[NUM_CODE_LENGTH_CODES];
-	unsigned bitlen[NUM_DEFLATE_CODE_SYMBOLS];
-	unsigned bitlenD[NUM_DISTANCE_SYMBOLS];
-	unsigned n, hlit, hdist, hclen, i;
-
-	/*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated */
-	/*C-code note: use no "return" between ctor and dtor of an uivector! */
-	if ((*bp) >> 3 >= inlength - 2) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
-		return;
-	}
+	s->source = &upng->source;
+	s->chunk = upng->idat[0].offset;
+	s->length = s->rest = upng->idat[0].length;
+	s->index = upng->idat + 1;
+	s->indexed = (upng->idat_count < UPNG_IDAT_INDEX ? upng->idat_count : UPNG_IDAT_INDEX) - 1;
+	s->remaining = upng->idat_count - 1;
+	s->next = s->limit = NULL;
+	s->bitbuf = 0;
+	s->bitcount = 0;
+	s->overrun = 0;
+	s->crc_table = upng->crc_table;
+	s->corrupt = 0;
+}
 
-	/* clear bitlen arrays */
-	memset(bitlen, 0, sizeof(bitlen));
-	memset(bitlenD, 0, sizeof(bitlenD));
+/* read the unread part of the payload the stream is at into the window again, after something else read the PNG
+   there; a PNG in memory stays where it is */
+static void uz_stream_reload(uz_stream* s)
+{
+	unsigned long n = (unsigned long)(s->limit - s->next);
 
-	/*the bit pointer is or will go past the memory */
-	hlit = read_bits(bp, in, 5) + 257;	/*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already */
-	hdist = read_bits(bp, in, 5) + 1;	/*number of distance codes. Unlike the spec, the value 1 is added to it here already */
-	hclen = read_bits(bp, in, 4) + 4;	/*number of code length codes. Unlike the spec, the value 4 is added to it here already */
+	if (s->source->read != NULL && n > 0) {
+		s->next = upng_source_at(s->source, s->chunk + 8 + s->length - s->rest - n, n);
+		s->limit = s->next != NULL ? s->next + n : NULL;
+	}
+}
 
-	for (i = 0; i < NUM_CODE_LENGTH_CODES; i++) {
-		if (i < hclen) {
-			codelengthcode[CLCL[i]] = read_bits(bp, in, 3);
-		} else {
-			codelengthcode[CLCL[i]] = 0;	/*if not, it must stay 0 */
+/* fetch the next whole byte of the stream; return value is -1 if the IDAT data ran out */
+static int uz_stream_byte(uz_stream* s)
+{
+	while (s->next == s->limit) {
+		if (!uz_stream_next_chunk(s)) {
+			return -1;
 		}
 	}
 
-	huffman_tree_create_lengths(upng, codelengthcodetree, codelengthcode);
+	return *s->next++;
+}
+
+/* fetch the next whole byte of the stream; running out of IDAT data is an error */
+static unsigned char uz_read_byte(upng_t* upng, uz_stream* s)
+{
+	int byte = uz_stream_byte(s);
 
-	/* bail now if we encountered an error earlier */
-	if (upng->error != UPNG_EOK) {
-		return;
+	if (byte < 0) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return 0;
 	}
 
-	/*now we can use this tree to read the lengths for the tree that this function will return */
-	i = 0;
-	while (i < hlit + hdist) {	/*i is the current symbol we're reading in the part that contains the code lengths of lit/len codes and dist codes */
-		unsigned code = huffman_decode_symbol(upng, in, bp, codelengthcodetree, inlength);
-		if (upng->error != UPNG_EOK) {
-			break;
+	return (unsigned char)byte;
+}
+
+/* read the Adler-32 that follows the deflate data and compare it with adler, the one of the inflated data. the deflate
+   data ends in the last byte fetched into bitbuf, whose remaining bits are padding; whole bytes still in bitbuf
+   come before those left in the stream */
+static void uz_check_adler(upng_t* upng, uz_stream* s, unsigned long long bitbuf, unsigned bitcount, unsigned long adler)
+{
+	unsigned long stored = 0;
+	unsigned i;
+
+	bitbuf >>= bitcount & 7;
+	bitcount -= bitcount & 7;
+
+	for (i = 0; i < 4; i++) {
+		int byte;
+
+		if (bitcount >= 8) {
+			byte = (int)(bitbuf & 255);
+			bitbuf >>= 8;
+			bitcount -= 8;
+		} else {
+			byte = uz_stream_byte(s);
 		}
 
-		if (code <= 15) {	/*a length code */
-			if (i < hlit) {
-				bitlen[i] = code;
-			} else {
-				bitlenD[i - hlit] = code;
-			}
-			i++;
-		} else if (code == 16) {	/*repeat previous */
-			unsigned replength = 3;	/*read in the 2 bits that indicate repeat length (3-6) */
-			unsigned value;	/*set value to the previous code */
+		/* error: the stream ends without the checksum */
+		if (byte < 0) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			return;
+		}
+		stored = stored << 8 | (unsigned long)byte;
+	}
 
-			if ((*bp) >> 3 >= inlength) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				break;
-			}
-			/*error, bit pointer jumps past memory */
-			replength += read_bits(bp, in, 2);
+	if (stored != adler) {
+		SET_ERROR(upng, UPNG_ECHECKSUM);
+	}
+}
 
-			if ((i - 1) < hlit) {
-				value = bitlen[i - 1];
-			} else {
-				value = bitlenD[i - hlit - 1];
-			}
+#ifndef UPNG_TINFL_ONLY
+/* top up bitbuf with one word load, to at least UZ_BITBUF_BITS - 8 bits; bits above bitcount may then already hold part
+   of the next byte, which is ORed in again unchanged. there must be at least sizeof(uz_bitbuf) bytes left in the payload */
+static inline void refill_word(uz_stream* s)
+{
+	uz_bitbuf word;
+	unsigned nbytes = (unsigned)(UZ_BITBUF_BITS - 1 - s->bitcount) >> 3;
 
-			/*repeat this value in the next lengths */
-			for (n = 0; n < replength; n++) {
-				/* i is larger than the amount of codes */
-				if (i >= hlit + hdist) {
-					SET_ERROR(upng, UPNG_EMALFORMED);
-					break;
-				}
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(&word, s->next, sizeof(word));
+#else
+	unsigned i;
+	for (word = 0, i = 0; i < sizeof(word); i++) {
+		word |= (uz_bitbuf)s->next[i] << (i * 8);
+	}
+#endif
+	s->bitbuf |= word << s->bitcount;
+	s->next += nbytes;
+	s->bitcount += nbytes * 8;
+}
 
-				if (i < hlit) {
-					bitlen[i] = value;
-				} else {
-					bitlenD[i - hlit] = value;
-				}
-				i++;
-			}
-		} else if (code == 17) {	/*repeat "0" 3-10 times */
-			unsigned replength = 3;	/*read in the bits that indicate repeat length */
-			if ((*bp) >> 3 >= inlength) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				break;
-			}
+/* top up bitbuf to (nearly) full, so up to UZ_BITBUF_BITS - 8 bits can be peeked. within an IDAT payload this is
+   one word load; bits above bitcount may then already hold part of the next byte, which is ORed in again unchanged.
+   past the end of the data zero bytes are supplied, so a short code at the very end can still be looked up with a
+   full table index; consuming them is an error, which is noticed here at the next refill, or by check_bits */
+static void fill_bits(upng_t* upng, uz_stream* s)
+{
+	unsigned nbytes = (unsigned)(UZ_BITBUF_BITS - 1 - s->bitcount) >> 3;
+
+	/* error: consumed some of the padding past the end of the data */
+	if (s->bitcount < s->overrun * 8) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+	}
 
-			/*error, bit pointer jumps past memory */
-			replength += read_bits(bp, in, 3);
+	if (nbytes == 0) {
+		return;
+	}
 
-			/*repeat this value in the next lengths */
-			for (n = 0; n < replength; n++) {
-				/* error: i is larger than the amount of codes */
-				if (i >= hlit + hdist) {
-					SET_ERROR(upng, UPNG_EMALFORMED);
-					break;
-				}
+	if ((unsigned long)(s->limit - s->next) >= sizeof(uz_bitbuf)) {
+		refill_word(s);
+		return;
+	}
 
-				if (i < hlit) {
-					bitlen[i] = 0;
-				} else {
-					bitlenD[i - hlit] = 0;
-				}
-				i++;
-			}
-		} else if (code == 18) {	/*repeat "0" 11-138 times */
-			unsigned replength = 11;	/*read in the bits that indicate repeat length */
-			/* error, bit pointer jumps past memory */
-			if ((*bp) >> 3 >= inlength) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
+	/* close to the end of a payload: a byte at a time, moving on to the next IDAT chunk as needed */
+	while (nbytes-- > 0) {
+		while (s->next == s->limit) {
+			if (!uz_stream_next_chunk(s)) {
 				break;
 			}
+		}
 
-			replength += read_bits(bp, in, 7);
-
-			/*repeat this value in the next lengths */
-			for (n = 0; n < replength; n++) {
-				/* i is larger than the amount of codes */
-				if (i >= hlit + hdist) {
-					SET_ERROR(upng, UPNG_EMALFORMED);
-					break;
-				}
-				if (i < hlit)
-					bitlen[i] = 0;
-				else
-					bitlenD[i - hlit] = 0;
-				i++;
-			}
+		if (s->next < s->limit) {
+			s->bitbuf |= (uz_bitbuf)*s->next++ << s->bitcount;
 		} else {
-			/* somehow an unexisting code appeared. This can never happen. */
-			SET_ERROR(upng, UPNG_EMALFORMED);
-			break;
+			s->overrun++;
 		}
+		s->bitcount += 8;
 	}
+}
 
-	if (upng->error == UPNG_EOK && bitlen[256] == 0) {
+/* error if any of the padding past the end of the data was consumed since the last refill */
+static void check_bits(upng_t* upng, uz_stream* s)
+{
+	if (s->bitcount < s->overrun * 8) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 	}
+}
 
-	/*the length of the end code 256 must be larger than 0 */
-	/*now we've finally got hlit and hdist, so generate the code trees, and the function is done */
-	if (upng->error == UPNG_EOK) {
-		huffman_tree_create_lengths(upng, codetree, bitlen);
-	}
-	if (upng->error == UPNG_EOK) {
-		huffman_tree_create_lengths(upng, codetreeD, bitlenD);
-	}
+static void drop_bits(uz_stream* s, unsigned nbits)
+{
+	s->bitbuf >>= nbits;
+	s->bitcount -= nbits;
 }
 
-/*inflate a block with dynamic of fixed Huffman tree*/
-static void inflate_huffman(upng_t* upng, unsigned char* out, unsigned long outsize, const unsigned char *in, unsigned long *bp, unsigned long *pos, unsigned long inlength, unsigned btype)
+/* read up to 16 bits */
+static unsigned read_bits(upng_t* upng, uz_stream* s, unsigned nbits)
 {
-	unsigned codetree_buffer[DEFLATE_CODE_BUFFER_SIZE];
-	unsigned codetreeD_buffer[DISTANCE_BUFFER_SIZE];
-	unsigned done = 0;
+	unsigned result;
 
-	huffman_tree codetree;
-	huffman_tree codetreeD;
-  psleep(1);
-  APP_LOG(APP_LOG_LEVEL_DEBUG, "huffman");
-  psleep(10);
-  APP_LOG(APP_LOG_LEVEL_DEBUG, "huffman");
-  psleep(10);
-  APP_LOG(APP_LOG_LEVEL_DEBUG, "huffman");
-  psleep(10);
+	if (s->bitcount < nbits) {
+		fill_bits(upng, s);
+	}
+	result = (unsigned)s->bitbuf & ((1U << nbits) - 1);
+	drop_bits(s, nbits);
+	return result;
+}
+#endif
 
-	if (btype == 1) {
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "start btype 1");
-		/* fixed trees */
-		huffman_tree_init(&codetree, (unsigned*)FIXED_DEFLATE_CODE_TREE, NUM_DEFLATE_CODE_SYMBOLS, DEFLATE_CODE_BITLEN);
-		huffman_tree_init(&codetreeD, (unsigned*)FIXED_DISTANCE_TREE, NUM_DISTANCE_SYMBOLS, DISTANCE_BITLEN);
-	} else if (btype == 2) {
-		/* dynamic trees */
-		unsigned codelengthcodetree_buffer[CODE_LENGTH_BUFFER_SIZE];
-		huffman_tree codelengthcodetree;
+/* bytes of luma held back while the cut points for auto levels are not picked yet: 16 scanlines of the screen */
+#ifndef UPNG_LEVELS_DELAY
+#define UPNG_LEVELS_DELAY 2304
+#endif
 
-		huffman_tree_init(&codetree, codetree_buffer, NUM_DEFLATE_CODE_SYMBOLS, DEFLATE_CODE_BITLEN);
-		huffman_tree_init(&codetreeD, codetreeD_buffer, NUM_DISTANCE_SYMBOLS, DISTANCE_BITLEN);
-		huffman_tree_init(&codelengthcodetree, codelengthcodetree_buffer, NUM_CODE_LENGTH_CODES, CODE_LENGTH_BITLEN);
-		get_tree_inflate_dynamic(upng, &codetree, &codetreeD, &codelengthcodetree, in, bp, inlength);
+/* Adam7 passes: first column and row of each pass, and the distance between its columns and rows */
+static const unsigned ADAM7_IX[7] = { 0, 4, 0, 2, 0, 1, 0 };
+static const unsigned ADAM7_IY[7] = { 0, 0, 4, 0, 2, 0, 1 };
+static const unsigned ADAM7_DX[7] = { 8, 8, 4, 4, 2, 2, 1 };
+static const unsigned ADAM7_DY[7] = { 8, 8, 8, 4, 4, 2, 2 };
+
+/* receives the inflated data when decoding scanline by scanline, see upng_decode_rows */
+typedef struct upng_scanlines {
+	unsigned char*		lines;		/* two buffers for scanlines that need assembling or unfiltering, allocated when first needed */
+	const unsigned char*	previous;	/* previous unfiltered scanline of the pass, NULL before the first one is done */
+	unsigned char*		image;		/* when set, the scanlines are unfiltered into the image buffer instead of being passed on */
+	unsigned long		stride;		/* bytes from one row of image to the next, 0 for the image buffer's own layout */
+	unsigned long		linebytes;	/* bytes per scanline of the current pass, without the filter type byte */
+	unsigned long		fill;		/* bytes of the scanline being assembled so far */
+	unsigned			bytewidth;
+	unsigned			bpp;
+	unsigned			y;			/* scanline within the current pass */
+	unsigned			pass;		/* current Adam7 pass; images that are not interlaced have a single pass */
+	unsigned			passes;
+	unsigned			width;		/* pixels and scanlines of the current pass */
+	unsigned			height;
+	int					stable;		/* fed data stays valid until the decode is done, so scanlines can be used where they are */
+	int					preview;	/* with image set, pixels also cover the pixels later Adam7 passes have not filled in yet */
+	int					levels;		/* pixels are turned into black, gray and white, see upng_output */
+	int					planes;		/* with image set, the image buffer holds UPNG_OUTPUT_PLANES bit planes */
+	upng_dither			dither;
+	short*				errors;		/* for error diffusion, the error carried to each pixel of the next scanline, allocated when first needed */
+	unsigned char*		out;		/* UPNG_OUTPUT_LEVELS scanline for the row callback, allocated when first needed */
+	const unsigned char*	palette;	/* for indexed images, maps the unfiltered bytes to gray levels */
+	unsigned			image_width;	/* size of the decoded image, smaller than the source when scaling */
+	unsigned			image_height;
+	unsigned long*		sums;		/* when scaling, the samples added up for the output scanline, allocated when first needed */
+	int					autolevels;	/* the cut points are picked from the histogram, see upng_levels */
+	unsigned long*		histogram;	/* luma counts in 64 bins until the cut points are picked, allocated when first needed */
+	unsigned char*		delay;		/* luma of the scanlines held back until then: output scanlines, or the first Adam7 pass */
+	unsigned			delayed;	/* scanlines in delay */
+	unsigned			delay_rows;	/* output scanlines delay has room for */
+	unsigned char*		tone;		/* once the cut points are picked, maps luma so they land on 64 and 192 */
+	int					composite;	/* alpha is composited against the background, see upng_set_background */
+	unsigned char*		gray;		/* the composited scanline, allocated when first needed */
+	upng_row_callback	callback;
+	upng_pass_callback	pass_callback;
+	void*				user;
+} upng_scanlines;
+
+/* where the inflated data goes: either one buffer big enough for the whole stream, or, when
+   scanlines is set, a sliding window whose contents are handed on to it as the window fills */
+typedef struct uz_output {
+	unsigned char*		buffer;
+	unsigned long		size;		/* size of buffer */
+	unsigned long		pos;		/* write position in buffer */
+	unsigned long		base;		/* bytes that went through the window before the current pass */
+	unsigned long		limit;		/* size of the whole inflated stream */
+	unsigned long		flushed;	/* bytes of buffer before this position were handed on already */
+	unsigned long		flush_at;	/* hand on data as soon as this many bytes are pending */
+	unsigned long		stop;		/* inflating stops once the stream reaches this size, to go on with the next call */
+	unsigned long		adler;		/* when verifying, Adler-32 of the data before position checked */
+	unsigned long		checked;
+	upng_scanlines*		scanlines;
+} uz_output;
+
+static void upng_scanlines_feed(upng_t* upng, upng_scanlines* rows, const unsigned char* data, unsigned long length);
+
+/* add the data inflated since the last check to the Adler-32, when verifying */
+static void uz_output_check(upng_t* upng, uz_output* o)
+{
+	if (upng->verify != UPNG_VERIFY_NONE) {
+		o->adler = uz_adler32(o->adler, o->buffer + o->checked, o->pos - o->checked);
+		o->checked = o->pos;
 	}
+}
 
-  APP_LOG(APP_LOG_LEVEL_DEBUG, "start decode symbol");
-	while (done == 0) {
-		unsigned code = huffman_decode_symbol(upng, in, bp, &codetree, inlength);
-		if (upng->error != UPNG_EOK) {
-			return;
-		}
+/* hand the data inflated since the last flush on to the scanline decoder */
+static void uz_output_flush(upng_t* upng, uz_output* o)
+{
+	uz_output_check(upng, o);
+	if (o->scanlines != NULL && o->pos > o->flushed) {
+		upng_scanlines_feed(upng, o->scanlines, o->buffer + o->flushed, o->pos - o->flushed);
+		o->flushed = o->pos;
+	}
+}
 
-		if (code == 256) {
-			/* end code */
-			done = 1;
-		} else if (code <= 255) {
-			/* literal symbol */
-			if ((*pos) >= outsize) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				return;
-			}
+/* the write position reached the end of the buffer; start a new pass through the window,
+   or fail if there is no window or the stream would grow past the expected size */
+static int uz_output_wrap(upng_t* upng, uz_output* o)
+{
+	if (o->scanlines == NULL || o->base + o->pos >= o->limit) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return 0;
+	}
 
-			/* store output */
-			out[(*pos)++] = (unsigned char)(code);
-		} else if (code >= FIRST_LENGTH_CODE_INDEX && code <= LAST_LENGTH_CODE_INDEX) {	/*length code */
-			/* part 1: get length base */
-			unsigned long length = LENGTH_BASE[code - FIRST_LENGTH_CODE_INDEX];
-			unsigned codeD, distance, numextrabitsD;
-			unsigned long start, forward, backward, numextrabits;
+	uz_output_flush(upng, o);
+	o->base += o->pos;
+	o->pos = 0;
+	o->flushed = 0;
+	o->checked = 0;
+	return upng->error == UPNG_EOK;
+}
 
-			/* part 2: get extra bits and add the value of that to length */
-			numextrabits = LENGTH_EXTRA[code - FIRST_LENGTH_CODE_INDEX];
+/* where an inflate ran out of budget, see upng_decode_step; it goes on from there with the next call */
+typedef struct uz_inflate_state {
+	unsigned		block;		/* UZ_BLOCK_* of the block being inflated */
+	unsigned		last;		/* the block being inflated is the last one */
+	unsigned long	stored;		/* bytes of the stored block still to copy */
+	unsigned long	total;		/* bytes of a stream of stored blocks only walked so far, and their Adler-32 */
+	unsigned long	adler;
+#ifndef UPNG_TINFL_ONLY
+	huffman_tree	codetree;	/* trees of the huffman block being inflated */
+	huffman_tree	codetreeD;
+	uz_trees*		trees;		/* the tables of dynamic trees, allocated with the first block that has them */
+#endif
+#ifdef UPNG_TINFL
+	tinfl_decompressor*	tinfl;	/* allocated when first needed */
+	unsigned long	ratio;		/* bytes tinfl puts out per byte of input lately, to size the next slice with */
+#endif
+} uz_inflate_state;
 
-			/* error, bit pointer will jump past memory */
-			if (((*bp) >> 3) >= inlength) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				return;
+#define UZ_BLOCK_NONE		0	/* between blocks */
+#define UZ_BLOCK_STORED		1
+#define UZ_BLOCK_HUFFMAN	2
+
+/* bytes per byte of input tinfl is assumed to put out, until it has put out some */
+#define UZ_TINFL_RATIO 8
+
+static void uz_inflate_init(uz_inflate_state* state)
+{
+	memset(state, 0, sizeof(*state));
+	state->adler = 1;
+#ifdef UPNG_TINFL
+	state->ratio = UZ_TINFL_RATIO;
+#endif
+}
+
+/* give back the memory of an inflate, done or not */
+static void uz_inflate_release(upng_t* upng, uz_inflate_state* state)
+{
+#ifndef UPNG_TINFL_ONLY
+	upng_dealloc(upng, state->trees);
+	state->trees = NULL;
+#endif
+#ifdef UPNG_TINFL
+	upng_dealloc(upng, state->tinfl);
+	state->tinfl = NULL;
+#endif
+}
+
+/* where an inflate that got to done bytes stops, given budget more */
+static unsigned long uz_inflate_stop(unsigned long done, unsigned long budget)
+{
+	return budget > ULONG_MAX - done ? ULONG_MAX : done + budget;
+}
+
+/* a deflate stream of stored blocks only needs no inflating, its data can be used right where it lies in the
+   IDAT chunks. walk the block headers from just after the zlib header, going on from where state (set up with
+   uz_inflate_init) stopped; return value is 1 if all blocks are stored and together hold exactly size bytes, 0 if
+   not, or -1 once stop bytes went through, to go on with the next call. if rows is set, the data is handed to it
+   along the way */
+static int uz_stream_stored(upng_t* upng, uz_stream* s, unsigned long size, upng_scanlines* rows, uz_inflate_state* state, unsigned long stop)
+{
+	do {
+		if (state->block == UZ_BLOCK_NONE) {
+			int header, b0, b1, b2, b3;
+			unsigned long len;
+
+			/* every block starts on a byte boundary when all before it are stored, the BTYPE bits must be 00 */
+			header = uz_stream_byte(s);
+			if (header < 0 || (header & 6) != 0) {
+				return 0;
 			}
-			length += read_bits(bp, in, numextrabits);
 
-			/*part 3: get distance code */
-			codeD = huffman_decode_symbol(upng, in, bp, &codetreeD, inlength);
-			if (upng->error != UPNG_EOK) {
-				return;
+			b0 = uz_stream_byte(s);
+			b1 = uz_stream_byte(s);
+			b2 = uz_stream_byte(s);
+			b3 = uz_stream_byte(s);
+			if (b3 < 0 || (b0 ^ b2) != 255 || (b1 ^ b3) != 255) {
+				return 0;
 			}
 
-			/* invalid distance code (30-31 are never used) */
-			if (codeD > 29) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				return;
+			len = b0 | (b1 << 8);
+			if (len > size - state->total) {
+				return 0;
 			}
 
-			distance = DISTANCE_BASE[codeD];
+			state->last = header & 1;
+			state->stored = len;
+			state->block = UZ_BLOCK_STORED;
+		}
 
-			/*part 4: get extra bits from distance */
-			numextrabitsD = DISTANCE_EXTRA[codeD];
+		while (state->stored > 0) {
+			unsigned long n;
 
-			/* error, bit pointer will jump past memory */
-			if (((*bp) >> 3) >= inlength) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				return;
+			if (state->total >= stop) {
+				return -1;
 			}
 
-			distance += read_bits(bp, in, numextrabitsD);
-
-			/*part 5: fill in all the out[n] values based on the length and dist */
-			start = (*pos);
-			backward = start - distance;
-
-			if ((*pos) + length >= outsize) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				return;
+			while (s->next == s->limit) {
+				if (!uz_stream_next_chunk(s)) {
+					return 0;
+				}
 			}
 
-			for (forward = 0; forward < length; forward++) {
-				out[(*pos)++] = out[backward];
-				backward++;
+			n = (unsigned long)(s->limit - s->next);
+			if (n > state->stored) {
+				n = state->stored;
+			}
+			if (n > stop - state->total) {
+				n = stop - state->total;
+			}
 
-				if (backward >= start) {
-					backward = start - distance;
+			if (rows != NULL) {
+				if (upng->verify != UPNG_VERIFY_NONE) {
+					state->adler = uz_adler32(state->adler, s->next, n);
+				}
+				upng_scanlines_feed(upng, rows, s->next, n);
+				if (upng->error != UPNG_EOK) {
+					return 0;
 				}
 			}
+
+			s->next += n;
+			state->stored -= n;
+			state->total += n;
 		}
-	}
-}
-#endif //ifdef TINFL
 
-static void inflate_uncompressed(upng_t* upng, unsigned char* out, unsigned long outsize, const unsigned char *in, unsigned long *bp, unsigned long *pos, unsigned long inlength)
-{
-	unsigned long p;
-	unsigned len, nlen, n;
+		state->block = UZ_BLOCK_NONE;
+	} while (!state->last);
 
-	/* go to first boundary of byte */
-	while (((*bp) & 0x7) != 0) {
-		(*bp)++;
+	if (rows != NULL && state->total == size && upng->verify != UPNG_VERIFY_NONE) {
+		uz_check_adler(upng, s, 0, 0, state->adler);
 	}
-	p = (*bp) / 8;		/*byte position */
 
-	/* read len (2 bytes) and nlen (2 bytes) */
-	if (p >= inlength - 4) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
-		return;
-	}
+	return state->total == size;
+}
 
-	len = in[p] + 256 * in[p + 1];
-	p += 2;
-	nlen = in[p] + 256 * in[p + 1];
-	p += 2;
+#ifndef UPNG_TINFL_ONLY
+static void huffman_tree_init(huffman_tree* tree, const unsigned short* table, unsigned size, unsigned rootbits)
+{
+	tree->table = table;
+	tree->size = size;
+	tree->rootbits = rootbits;
+}
 
-	/* check if 16-bit nlen is really the one's complement of len */
-	if (len + nlen != 65535) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
-		return;
+/* deflate sends huffman codes most significant bit first, the table is indexed with them as they come out of bitbuf */
+static unsigned huffman_reverse(unsigned code, unsigned bits)
+{
+	unsigned result = 0;
+	while (bits-- > 0) {
+		result = (result << 1) | (code & 1);
+		code >>= 1;
 	}
+	return result;
+}
 
-	if ((*pos) + len >= outsize) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
-		return;
-	}
+/*given the code lengths (as stored in the PNG file), generate the lookup table for the code as defined by Deflate into
+  table, which tree was set up with. return value is error.*/
+static void huffman_tree_create_lengths(upng_t* upng, huffman_tree* tree, unsigned short* table, const unsigned char* bitlen, unsigned numcodes)
+{
+	unsigned short blcount[MAX_BIT_LENGTH + 1];
+	unsigned short nextcode[MAX_BIT_LENGTH + 1];
+	unsigned short code[MAX_BIT_LENGTH + 1];
+	unsigned rootsize = 1U << tree->rootbits;
+	unsigned used = rootsize;	/*entries taken by the first level and the subtables so far */
+	int left = 1;	/*codes of the current length still available */
+	unsigned bits, n, i;
 
-	/* read the literal data: len bytes are now stored in the out buffer */
-	if (p + len > inlength) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
-		return;
+	/*step 1: count number of instances of each code length */
+	memset(blcount, 0, sizeof(blcount));
+	for (n = 0; n < numcodes; n++) {
+		blcount[bitlen[n]]++;
+	}
+	blcount[0] = 0;
+
+	/*step 2: generate the nextcode values, the code is over-subscribed if there are more codes of a length than are left */
+	nextcode[0] = 0;
+	for (bits = 1; bits <= MAX_BIT_LENGTH; bits++) {
+		nextcode[bits] = (unsigned short)((nextcode[bits - 1] + blcount[bits - 1]) << 1);
+		left = (left << 1) - (int)blcount[bits];
+		if (left < 0) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			return;
+		}
 	}
 
-	for (n = 0; n < len; n++) {
-		out[(*pos)++] = in[p++];
+	/*step 3: codes longer than rootbits share the first level entry of their first rootbits bits, which links to a subtable
+	  indexed by the remaining bits. find the subtable sizes: the root entries temporarily hold the most remaining bits of any of their codes */
+	memset(table, 0, rootsize * sizeof(table[0]));
+	memcpy(code, nextcode, sizeof(code));
+	for (n = 0; n < numcodes; n++) {
+		bits = bitlen[n];
+		if (bits > tree->rootbits) {
+			unsigned index = huffman_reverse(code[bits], bits) & (rootsize - 1);
+			if (table[index] < bits - tree->rootbits) {
+				table[index] = (unsigned short)(bits - tree->rootbits);
+			}
+		}
+		code[bits]++;
 	}
 
-	(*bp) = p * 8;
-}
+	/*step 4: lay out the subtables after the first level */
+	for (i = 0; i < rootsize; i++) {
+		if (table[i] != 0) {
+			unsigned subbits = table[i];
 
-/*inflate the deflated data (cfr. deflate spec); return value is the error*/
-static upng_error uz_inflate_data(upng_t* upng, unsigned char* out, unsigned long outsize, const unsigned char *in, unsigned long insize, unsigned long inpos)
-{
-      APP_LOG(APP_LOG_LEVEL_DEBUG, "uz_inflate_data");
-	unsigned long bp = 0;	/*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte) */
-	unsigned long pos = 0;	/*byte position in the out buffer */
+			if (used + (1U << subbits) > tree->size) {
+				SET_ERROR(upng, UPNG_EMALFORMED);
+				return;
+			}
 
-	unsigned done = 0;
+			table[i] = (unsigned short)(HUFFMAN_LINK | (subbits << 10) | used);
+			memset(table + used, 0, (1U << subbits) * sizeof(table[0]));
+			used += 1U << subbits;
+		}
+	}
 
-	while (done == 0) {
-		unsigned btype;
+	/*step 5: fill in every entry whose index starts with a code; these are all the indices that have the code's bits at the bottom */
+	memcpy(code, nextcode, sizeof(code));
+	for (n = 0; n < numcodes; n++) {
+		unsigned short entry;
+		unsigned reversed;
 
-		/* ensure next bit doesn't point past the end of the buffer */
-		if ((bp >> 3) >= insize) {
-      APP_LOG(APP_LOG_LEVEL_DEBUG, "malformed upng");
-			SET_ERROR(upng, UPNG_EMALFORMED);
-			return upng->error;
+		bits = bitlen[n];
+		if (bits == 0) {
+			continue;
 		}
 
-		/* read block control bits */
-		done = read_bit(&bp, &in[inpos]);
-		btype = read_bit(&bp, &in[inpos]) | (read_bit(&bp, &in[inpos]) << 1);
+		reversed = huffman_reverse(code[bits]++, bits);
+		entry = (unsigned short)((bits << 9) | n);
 
-		/* process control type appropriateyly */
-		if (btype == 3) {
-      APP_LOG(APP_LOG_LEVEL_DEBUG, "malformed2 upng");
-			SET_ERROR(upng, UPNG_EMALFORMED);
-			return upng->error;
-		} else if (btype == 0) {
-			inflate_uncompressed(upng, out, outsize, &in[inpos], &bp, &pos, insize);	/*no compression */
+		if (bits <= tree->rootbits) {
+			for (i = reversed; i < rootsize; i += 1U << bits) {
+				table[i] = entry;
+			}
 		} else {
-      APP_LOG(APP_LOG_LEVEL_DEBUG, "start huffman");
-#ifndef TINFL			
-      inflate_huffman(upng, out, outsize, &in[inpos], &bp, &pos, insize, btype);	/*compression, btype 01 or 10 */
-#else
-      tinfl_decompressor inflator;
-      tinfl_init(&inflator);
-      tinfl_decompress(&inflator, &in[inpos], (size_t*)&insize, out, out, (uint8_t*)&outsize, 0);
-			inflate_uncompressed(upng, out, outsize, &in[inpos], &bp, &pos, insize);	/*no compression */
-#endif
-      APP_LOG(APP_LOG_LEVEL_DEBUG, "done huffman");
-		}
+			unsigned link = table[reversed & (rootsize - 1)];
+			unsigned short* sub = table + HUFFMAN_SUB_OFFSET(link);
 
-		/* stop if an error has occured */
-		if (upng->error != UPNG_EOK) {
-      APP_LOG(APP_LOG_LEVEL_DEBUG, "error upng");
-			return upng->error;
+			for (i = reversed >> tree->rootbits; i < (1U << HUFFMAN_SUB_BITS(link)); i += 1U << (bits - tree->rootbits)) {
+				sub[i] = entry;
+			}
 		}
 	}
-
-	return upng->error;
 }
 
-static upng_error uz_inflate(upng_t* upng, unsigned char *out, unsigned long outsize, const unsigned char *in, unsigned long insize)
+/* the table entry for the code at the bottom of bits, which must hold at least MAX_BIT_LENGTH bits */
+static inline unsigned huffman_entry(const huffman_tree* codetree, unsigned bits)
 {
-      APP_LOG(APP_LOG_LEVEL_DEBUG, "uz_inflate");
-	/* we require two bytes for the zlib data header */
-	if (insize < 2) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
-		return upng->error;
-	}
+	unsigned entry = codetree->table[bits & ((1U << codetree->rootbits) - 1)];
 
-	/* 256 * in[0] + in[1] must be a multiple of 31, the FCHECK value is supposed to be made that way */
-	if ((in[0] * 256 + in[1]) % 31 != 0) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
-		return upng->error;
+	if (entry & HUFFMAN_LINK) {
+		unsigned index = (bits >> codetree->rootbits) & ((1U << HUFFMAN_SUB_BITS(entry)) - 1);
+		entry = codetree->table[HUFFMAN_SUB_OFFSET(entry) + index];
 	}
 
-	/*error: only compression method 8: inflate with sliding window of 32k is supported by the PNG spec */
-	if ((in[0] & 15) != 8 || ((in[0] >> 4) & 15) > 7) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
-		return upng->error;
+	return entry;
+}
+
+static unsigned huffman_decode_symbol(upng_t *upng, uz_stream* s, const huffman_tree* codetree)
+{
+	unsigned entry;
+
+	/* enough bits for the longest code, whichever table level it ends in */
+	if (s->bitcount < MAX_BIT_LENGTH) {
+		fill_bits(upng, s);
 	}
 
-	/* the specification of PNG says about the zlib stream: "The additional flags shall not specify a preset dictionary." */
-	if (((in[1] >> 5) & 1) != 0) {
+	entry = huffman_entry(codetree, (unsigned)s->bitbuf);
+
+	/* error: the bits are not the start of any code of an incomplete code */
+	if (HUFFMAN_LENGTH(entry) == 0) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
-		return upng->error;
+		return 0;
 	}
 
-	/* create output buffer */
-	uz_inflate_data(upng, out, outsize, in, insize, 2);
-
-	return upng->error;
+	drop_bits(s, HUFFMAN_LENGTH(entry));
+	return HUFFMAN_SYMBOL(entry);
 }
 
-/*Paeth predicter, used by PNG filter type 4*/
-static int paeth_predictor(int a, int b, int c)
+/* copy a match of length bytes from distance bytes back; when distance < length the source overlaps the
+   bytes being written and repeats them, which memcpy would not do, so every case gets its own copy */
+static void uz_copy_match(unsigned char* dst, unsigned long distance, unsigned long length)
 {
-	int p = a + b - c;
-	int pa = p > a ? p - a : a - p;
-	int pb = p > b ? p - b : b - p;
-	int pc = p > c ? p - c : c - p;
+	const unsigned char* src = dst - distance;
 
-	if (pa <= pb && pa <= pc)
-		return a;
-	else if (pb <= pc)
-		return b;
-	else
-		return c;
+	if (distance == 1) {
+		/* a run of the last byte, by far the most common match in flat image areas */
+		memset(dst, *src, length);
+	} else if (distance >= length) {
+		memcpy(dst, src, length);
+	} else {
+		/* a word at a time as long as a word never reaches into bytes not written yet */
+		if (distance >= 4) {
+			while (length >= 4) {
+				memcpy(dst, src, 4);
+				dst += 4;
+				src += 4;
+				length -= 4;
+			}
+		}
+		while (length-- > 0) {
+			*dst++ = *src++;
+		}
+	}
 }
 
-static void unfilter_scanline(upng_t* upng, unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long bytewidth, unsigned char filterType, unsigned long length)
+/* copy a match to the write position, which must have room for all of it; the source may still start in the
+   previous pass through the window, ahead of the write position */
+static void uz_output_match(uz_output* out, unsigned long distance, unsigned long length)
 {
-	/*
-	   For PNG filter method 0
-	   unfilter a PNG image scanline by scanline. when the pixels are smaller than 1 byte, the filter works byte per byte (bytewidth = 1)
-	   precon is the previous unfiltered scanline, recon the result, scanline the current one
-	   the incoming scanlines do NOT include the filtertype byte, that one is given in the parameter filterType instead
-	   recon and scanline MAY be the same memory address! precon must be disjoint.
-	 */
+	if (out->pos >= distance) {
+		uz_copy_match(out->buffer + out->pos, distance, length);
+		out->pos += length;
+	} else {
+		unsigned long backward = out->pos + out->size - distance;
+		unsigned long n = out->size - backward;
 
-	unsigned long i;
-	switch (filterType) {
-	case 0:
-		for (i = 0; i < length; i++)
-			recon[i] = scanline[i];
-		break;
-	case 1:
-		for (i = 0; i < bytewidth; i++)
-			recon[i] = scanline[i];
-		for (i = bytewidth; i < length; i++)
-			recon[i] = scanline[i] + recon[i - bytewidth];
-		break;
-	case 2:
-		if (precon)
-			for (i = 0; i < length; i++)
-				recon[i] = scanline[i] + precon[i];
-		else
-			for (i = 0; i < length; i++)
-				recon[i] = scanline[i];
-		break;
-	case 3:
-		if (precon) {
-			for (i = 0; i < bytewidth; i++)
-				recon[i] = scanline[i] + precon[i] / 2;
-			for (i = bytewidth; i < length; i++)
-				recon[i] = scanline[i] + ((recon[i - bytewidth] + precon[i]) / 2);
-		} else {
-			for (i = 0; i < bytewidth; i++)
-				recon[i] = scanline[i];
-			for (i = bytewidth; i < length; i++)
-				recon[i] = scanline[i] + recon[i - bytewidth] / 2;
+		/* the part up to the end of the buffer lies ahead of the write position, memmove copies that correctly */
+		if (n > length) {
+			n = length;
 		}
-		break;
-	case 4:
-		if (precon) {
-			for (i = 0; i < bytewidth; i++)
-				recon[i] = (unsigned char)(scanline[i] + paeth_predictor(0, precon[i], 0));
-			for (i = bytewidth; i < length; i++)
-				recon[i] = (unsigned char)(scanline[i] + paeth_predictor(recon[i - bytewidth], precon[i], precon[i - bytewidth]));
-		} else {
-			for (i = 0; i < bytewidth; i++)
-				recon[i] = scanline[i];
-			for (i = bytewidth; i < length; i++)
-				recon[i] = (unsigned char)(scanline[i] + paeth_predictor(recon[i - bytewidth], 0, 0));
+		memmove(out->buffer + out->pos, out->buffer + backward, n);
+		out->pos += n;
+
+		/* the rest continues at the start of the buffer */
+		if (length > n) {
+			uz_copy_match(out->buffer + out->pos, out->pos, length - n);
+			out->pos += length - n;
 		}
-		break;
-	default:
-		SET_ERROR(upng, UPNG_EMALFORMED);
-		break;
 	}
 }
 
-static void unfilter(upng_t* upng, unsigned char *out, const unsigned char *in, unsigned w, unsigned h, unsigned bpp)
+/* slack the fast loop needs: room for the longest match, and input for the three word refills a match may need */
+#define FAST_OUTPUT_SLACK 258
+#define FAST_INPUT_SLACK (3 * sizeof(uz_bitbuf))
+
+/* decode symbols without any bounds checks for as long as the current payload and the output have the slack for
+   another one, after the manner of zlib's inffast; the careful loop in inflate_huffman handles the rest.
+   it also stops at out->stop. return value is 1 if the end code was reached */
+static int inflate_huffman_fast(upng_t* upng, uz_output* out, uz_stream* s, const huffman_tree* codetree, const huffman_tree* codetreeD)
 {
-	/*
-	   For PNG filter method 0
-	   this function unfilters a single image (e.g. without interlacing this is called once, with Adam7 it's called 7 times)
-	   out must have enough bytes allocated already, in must have the scanlines + 1 filtertype byte per scanline
-	   w and h are image dimensions or dimensions of reduced image, bpp is bpp per pixel
-	   in and out are allowed to be the same memory address!
-	 */
+	unsigned long end = out->size >= FAST_OUTPUT_SLACK ? out->size - FAST_OUTPUT_SLACK + 1 : 0;
 
-	unsigned y;
-	unsigned char *prevline = 0;
+	/* the window only wraps in the careful loop, so base stays put in here */
+	if (end > out->stop - out->base) {
+		end = out->stop - out->base;
+	}
 
-	unsigned long bytewidth = (bpp + 7) / 8;	/*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise */
-	unsigned long linebytes = (w * bpp + 7) / 8;
+	while ((unsigned long)(s->limit - s->next) >= FAST_INPUT_SLACK && out->pos < end) {
+		unsigned entry, code, numextrabits;
+		unsigned long length, distance;
 
-	for (y = 0; y < h; y++) {
-		unsigned long outindex = linebytes * y;
-		unsigned long inindex = (1 + linebytes) * y;	/*the extra filterbyte added to each row */
-		unsigned char filterType = in[inindex];
+		/* a 32-bit buffer holds at least 24 bits after a refill, enough for a code and its extra bits */
+		if (s->bitcount < MAX_BIT_LENGTH + 5) {
+			refill_word(s);
+		}
 
-		unfilter_scanline(upng, &out[outindex], &in[inindex + 1], prevline, bytewidth, filterType, linebytes);
-		if (upng->error != UPNG_EOK) {
-			return;
+		entry = huffman_entry(codetree, (unsigned)s->bitbuf);
+		code = HUFFMAN_SYMBOL(entry);
+		if (HUFFMAN_LENGTH(entry) == 0 || code > LAST_LENGTH_CODE_INDEX) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			return 0;
 		}
+		drop_bits(s, HUFFMAN_LENGTH(entry));
 
-		prevline = &out[outindex];
-	}
-}
+		if (code <= 255) {
+			out->buffer[out->pos++] = (unsigned char)code;
+		} else if (code == 256) {
+			return 1;
+		} else {
+			code -= FIRST_LENGTH_CODE_INDEX;
+			numextrabits = LENGTH_EXTRA[code];
+			length = LENGTH_BASE[code] + ((unsigned)s->bitbuf & ((1U << numextrabits) - 1));
+			drop_bits(s, numextrabits);
 
-static void remove_padding_bits(unsigned char *out, const unsigned char *in, unsigned long olinebits, unsigned long ilinebits, unsigned h)
-{
-	/*
-	   After filtering there are still padding bpp if scanlines have non multiple of 8 bit amounts. They need to be removed (except at last scanline of (Adam7-reduced) image) before working with pure image buffers for the Adam7 code, the color convert code and the output to the user.
-	   in and out are allowed to be the same buffer, in may also be higher but still overlapping; in must have >= ilinebits*h bpp, out must have >= olinebits*h bpp, olinebits must be <= ilinebits
-	   also used to move bpp after earlier such operations happened, e.g. in a sequence of reduced images from Adam7
-	   only useful if (ilinebits - olinebits) is a value in the range 1..7
-	 */
-	unsigned y;
-	unsigned long diff = ilinebits - olinebits;
-	unsigned long obp = 0, ibp = 0;	/*bit pointers */
-	for (y = 0; y < h; y++) {
-		unsigned long x;
-		for (x = 0; x < olinebits; x++) {
-			unsigned char bit = (unsigned char)((in[(ibp) >> 3] >> (7 - ((ibp) & 0x7))) & 1);
-			ibp++;
+			if (s->bitcount < MAX_BIT_LENGTH) {
+				refill_word(s);
+			}
 
-			if (bit == 0)
-				out[(obp) >> 3] &= (unsigned char)(~(1 << (7 - ((obp) & 0x7))));
-			else
-				out[(obp) >> 3] |= (1 << (7 - ((obp) & 0x7)));
-			++obp;
+			entry = huffman_entry(codetreeD, (unsigned)s->bitbuf);
+			code = HUFFMAN_SYMBOL(entry);
+			if (HUFFMAN_LENGTH(entry) == 0 || code > 29) {
+				SET_ERROR(upng, UPNG_EMALFORMED);
+				return 0;
+			}
+			drop_bits(s, HUFFMAN_LENGTH(entry));
+
+			numextrabits = DISTANCE_EXTRA[code];
+			if (s->bitcount < numextrabits) {
+				refill_word(s);
+			}
+			distance = DISTANCE_BASE[code] + ((unsigned)s->bitbuf & ((1U << numextrabits) - 1));
+			drop_bits(s, numextrabits);
+
+			/* error, distance reaches back before the start of the output or the window */
+			if (distance > out->base + out->pos || distance > out->size) {
+				SET_ERROR(upng, UPNG_EMALFORMED);
+				return 0;
+			}
+
+			uz_output_match(out, distance, length);
+		}
+
+		/* pass on completed scanlines as soon as there are any */
+		if (out->pos - out->flushed >= out->flush_at) {
+			uz_output_flush(upng, out);
 		}
-		ibp += diff;
 	}
+
+	return 0;
 }
 
-/*out must be buffer big enough to contain full image, and in must contain the full decompressed data from the IDAT chunks*/
-static void post_process_scanlines(upng_t* upng, unsigned char *out, unsigned char *in, const upng_t* info_png)
+/* get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
+static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffman_tree* codetreeD, uz_trees* trees, uz_stream* s)
 {
-	unsigned bpp = upng_get_bpp(info_png);
-	unsigned w = info_png->width;
-	unsigned h = info_png->height;
+	unsigned char codelengthcode[NUM_CODE_LENGTH_CODES];
+	unsigned char* lengths = trees->lengths;
+	huffman_tree codelengthcodetree;
+	unsigned n, hlit, hdist, hclen, i;
 
-	if (bpp == 0) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
-		return;
-	}
+	/*the bit pointer is or will go past the memory */
+	hlit = read_bits(upng, s, 5) + 257;	/*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already */
+	hdist = read_bits(upng, s, 5) + 1;	/*number of distance codes. Unlike the spec, the value 1 is added to it here already */
+	hclen = read_bits(upng, s, 4) + 4;	/*number of code length codes. Unlike the spec, the value 4 is added to it here already */
 
-	if (bpp < 8 && w * bpp != ((w * bpp + 7) / 8) * 8) {
+	for (i = 0; i < NUM_CODE_LENGTH_CODES; i++) {
+		if (i < hclen) {
+			codelengthcode[CLCL[i]] = (unsigned char)read_bits(upng, s, 3);
+		} else {
+			codelengthcode[CLCL[i]] = 0;	/*if not, it must stay 0 */
+		}
+	}
+
+	/* bail now if the header ran past the end of the data */
+	if (upng->error != UPNG_EOK) {
+		return;
+	}
+
+	huffman_tree_init(&codelengthcodetree, trees->distance, CODE_LENGTH_TABLE_SIZE, CODE_LENGTH_ROOT_BITS);
+	huffman_tree_create_lengths(upng, &codelengthcodetree, trees->distance, codelengthcode, NUM_CODE_LENGTH_CODES);
+
+	/* bail now if we encountered an error earlier */
+	if (upng->error != UPNG_EOK) {
+		return;
+	}
+
+	/*now we can use this tree to read the lengths for the trees that this function will return: those of the
+	  literal/length codes and those of the distance codes follow each other, and repeats may run from one into the other */
+	i = 0;
+	while (i < hlit + hdist) {	/*i is the current symbol we're reading in the part that contains the code lengths of lit/len codes and dist codes */
+		unsigned code = huffman_decode_symbol(upng, s, &codelengthcodetree);
+		unsigned replength;
+		unsigned char value = 0;
+
+		if (upng->error != UPNG_EOK) {
+			break;
+		}
+
+		if (code <= 15) {	/*a length code */
+			lengths[i++] = (unsigned char)code;
+			continue;
+		} else if (code == 16) {	/*repeat previous 3-6 times */
+			/*error, there is no previous code to repeat */
+			if (i == 0) {
+				SET_ERROR(upng, UPNG_EMALFORMED);
+				break;
+			}
+			replength = 3 + read_bits(upng, s, 2);
+			value = lengths[i - 1];
+		} else if (code == 17) {	/*repeat "0" 3-10 times */
+			replength = 3 + read_bits(upng, s, 3);
+		} else if (code == 18) {	/*repeat "0" 11-138 times */
+			replength = 11 + read_bits(upng, s, 7);
+		} else {
+			/* somehow an unexisting code appeared. This can never happen. */
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			break;
+		}
+
+		/* error: the repeat runs past the amount of codes */
+		if (replength > hlit + hdist - i) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			break;
+		}
+		for (n = 0; n < replength; n++) {
+			lengths[i++] = value;
+		}
+	}
+
+	/*the length of the end code 256 must be larger than 0 */
+	if (upng->error == UPNG_EOK && lengths[256] == 0) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+	}
+
+	/*now we've finally got hlit and hdist, so generate the code trees, and the function is done. the distance table
+	  takes the place of the code length tree, which is done with */
+	if (upng->error == UPNG_EOK) {
+		huffman_tree_init(codetree, trees->code, DEFLATE_CODE_TABLE_SIZE, DEFLATE_CODE_ROOT_BITS);
+		huffman_tree_create_lengths(upng, codetree, trees->code, lengths, hlit);
+	}
+	if (upng->error == UPNG_EOK) {
+		huffman_tree_init(codetreeD, trees->distance, DISTANCE_TABLE_SIZE, DISTANCE_ROOT_BITS);
+		huffman_tree_create_lengths(upng, codetreeD, trees->distance, lengths + hlit, hdist);
+	}
+}
+
+/*set up the trees of a block with dynamic or fixed Huffman tree in state. the tables of dynamic trees go in
+  state->trees, allocated with the first block that has them*/
+static void inflate_huffman_begin(upng_t* upng, uz_stream* s, unsigned btype, uz_inflate_state* state)
+{
+	if (btype == 1) {
+		/* fixed trees, their tables are ready in flash */
+		huffman_tree_init(&state->codetree, FIXED_CODE_TABLE, 1U << FIXED_CODE_ROOT_BITS, FIXED_CODE_ROOT_BITS);
+		huffman_tree_init(&state->codetreeD, FIXED_DISTANCE_TABLE, 1U << FIXED_DISTANCE_ROOT_BITS, FIXED_DISTANCE_ROOT_BITS);
+	} else {
+		/* dynamic trees */
+		if (state->trees == NULL) {
+			state->trees = (uz_trees*)upng_alloc(upng, sizeof(uz_trees));
+			if (state->trees == NULL) {
+				SET_ERROR(upng, UPNG_ENOMEM);
+				return;
+			}
+		}
+
+		get_tree_inflate_dynamic(upng, &state->codetree, &state->codetreeD, state->trees, s);
+		if (upng->error != UPNG_EOK) {
+			return;
+		}
+	}
+
+	state->block = UZ_BLOCK_HUFFMAN;
+}
+
+/*inflate a block with dynamic of fixed Huffman tree, set up by inflate_huffman_begin. it stops between two symbols
+  once the output reaches out->stop, state->block is UZ_BLOCK_NONE once the end code was reached*/
+static void inflate_huffman(upng_t* upng, uz_output* out, uz_stream* s, uz_inflate_state* state)
+{
+	const huffman_tree* codetree = &state->codetree;
+	const huffman_tree* codetreeD = &state->codetreeD;
+	unsigned done = 0;
+
+	while (done == 0) {
+		unsigned code;
+
+		/* out of budget, the block goes on with the next call */
+		if (out->base + out->pos >= out->stop) {
+			return;
+		}
+
+		/* most of the block goes through the fast loop, here it only gets to the symbols close to the end of the payload or the output */
+		if (inflate_huffman_fast(upng, out, s, codetree, codetreeD)) {
+			break;
+		}
+		if (upng->error != UPNG_EOK) {
+			return;
+		}
+
+		code = huffman_decode_symbol(upng, s, codetree);
+		if (upng->error != UPNG_EOK) {
+			return;
+		}
+
+		if (code == 256) {
+			/* end code */
+			done = 1;
+		} else if (code <= 255) {
+			/* literal symbol */
+			if (out->pos == out->size && !uz_output_wrap(upng, out)) {
+				return;
+			}
+
+			/* store output */
+			out->buffer[out->pos++] = (unsigned char)(code);
+		} else if (code >= FIRST_LENGTH_CODE_INDEX && code <= LAST_LENGTH_CODE_INDEX) {	/*length code */
+			/* part 1: get length base */
+			unsigned long length = LENGTH_BASE[code - FIRST_LENGTH_CODE_INDEX];
+			unsigned codeD, distance, numextrabitsD;
+			unsigned long forward, backward, numextrabits;
+
+			/* part 2: get extra bits and add the value of that to length */
+			numextrabits = LENGTH_EXTRA[code - FIRST_LENGTH_CODE_INDEX];
+
+			length += read_bits(upng, s, numextrabits);
+
+			/*part 3: get distance code */
+			codeD = huffman_decode_symbol(upng, s, codetreeD);
+			if (upng->error != UPNG_EOK) {
+				return;
+			}
+
+			/* invalid distance code (30-31 are never used) */
+			if (codeD > 29) {
+				SET_ERROR(upng, UPNG_EMALFORMED);
+				return;
+			}
+
+			distance = DISTANCE_BASE[codeD];
+
+			/*part 4: get extra bits from distance */
+			numextrabitsD = DISTANCE_EXTRA[codeD];
+
+			distance += read_bits(upng, s, numextrabitsD);
+			if (upng->error != UPNG_EOK) {
+				return;
+			}
+
+			/* error, distance reaches back before the start of the output or the window */
+			if (distance > out->base + out->pos || distance > out->size) {
+				SET_ERROR(upng, UPNG_EMALFORMED);
+				return;
+			}
+
+			/*part 5: fill in all the out[n] values based on the length and dist */
+			if (out->pos + length <= out->size) {
+				uz_output_match(out, distance, length);
+			} else {
+				/* the copy runs into the end of the buffer; wrap the window as it goes */
+				backward = out->pos >= distance ? out->pos - distance : out->pos + out->size - distance;
+				for (forward = 0; forward < length; forward++) {
+					if (out->pos == out->size && !uz_output_wrap(upng, out)) {
+						return;
+					}
+
+					out->buffer[out->pos++] = out->buffer[backward++];
+					if (backward == out->size) {
+						backward = 0;
+					}
+				}
+			}
+		} else {
+			/* error: length codes 286 and 287 are never used */
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			return;
+		}
+
+		/* pass on completed scanlines as soon as there are any */
+		if (out->pos - out->flushed >= out->flush_at) {
+			uz_output_flush(upng, out);
+		}
+	}
+
+	state->block = UZ_BLOCK_NONE;
+}
+
+/* read the header of a stored block, and copy the bytes of it the huffman decoder fetched ahead */
+static void inflate_uncompressed_begin(upng_t* upng, uz_output* out, uz_stream* s, uz_inflate_state* state)
+{
+	unsigned len, nlen;
+
+	/* go to first boundary of byte */
+	drop_bits(s, s->bitcount & 7);
+
+	/* read len (2 bytes) and nlen (2 bytes) */
+	len = read_bits(upng, s, 16);
+	nlen = read_bits(upng, s, 16);
+	if (upng->error != UPNG_EOK) {
+		return;
+	}
+
+	/* check if 16-bit nlen is really the one's complement of len */
+	if (len + nlen != 65535) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return;
+	}
+
+	if (out->base + out->pos + len > out->limit) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return;
+	}
+
+	/* whole bytes the huffman decoder fetched ahead are still in bitbuf, they come first */
+	while (len > 0 && s->bitcount > 0) {
+		if (out->pos == out->size && !uz_output_wrap(upng, out)) {
+			return;
+		}
+
+		out->buffer[out->pos++] = (unsigned char)read_bits(upng, s, 8);
+		len--;
+	}
+
+	/* the rest comes straight from the payload; once bitbuf is empty it may still hold a copy of the next byte */
+	if (s->bitcount == 0) {
+		s->bitbuf = 0;
+	}
+	check_bits(upng, s);
+	if (upng->error != UPNG_EOK) {
+		return;
+	}
+
+	state->stored = len;
+	state->block = UZ_BLOCK_STORED;
+}
+
+/* copy the literal data of a stored block to the out buffer, a chunk at a time. it stops once the output reaches
+   out->stop, state->block is UZ_BLOCK_NONE once all of it is copied */
+static void inflate_uncompressed(upng_t* upng, uz_output* out, uz_stream* s, uz_inflate_state* state)
+{
+	while (state->stored > 0) {
+		unsigned long n;
+
+		/* out of budget, the block goes on with the next call */
+		if (out->base + out->pos >= out->stop) {
+			return;
+		}
+
+		while (s->next == s->limit) {
+			if (!uz_stream_next_chunk(s)) {
+				SET_ERROR(upng, UPNG_EMALFORMED);
+				return;
+			}
+		}
+
+		if (out->pos == out->size && !uz_output_wrap(upng, out)) {
+			return;
+		}
+
+		n = (unsigned long)(s->limit - s->next);
+		if (n > state->stored) {
+			n = state->stored;
+		}
+		if (n > out->size - out->pos) {
+			n = out->size - out->pos;
+		}
+		if (n > out->stop - out->base - out->pos) {
+			n = out->stop - out->base - out->pos;
+		}
+
+		memcpy(out->buffer + out->pos, s->next, n);
+		s->next += n;
+		out->pos += n;
+		state->stored -= n;
+
+		if (out->pos - out->flushed >= out->flush_at) {
+			uz_output_flush(upng, out);
+		}
+	}
+
+	state->block = UZ_BLOCK_NONE;
+}
+
+#endif //ifndef UPNG_TINFL_ONLY
+
+#ifdef UPNG_TINFL
+/*inflate the deflate data following the zlib header with tinfl, handing it one IDAT payload at a time*/
+static int uz_inflate_run_tinfl(upng_t* upng, uz_output* out, uz_stream* s, uz_inflate_state* state)
+{
+	tinfl_status status;
+	mz_uint32 flags = TINFL_FLAG_HAS_MORE_INPUT;
+
+	/* a buffer holding the whole stream can have any size, a window that wraps is always a power of 2 */
+	if (out->size >= out->limit) {
+		flags |= TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF;
+	}
+
+	/* the decompressor carries its huffman tables, far too big for the stack */
+	if (state->tinfl == NULL) {
+		state->tinfl = (tinfl_decompressor*)upng_alloc(upng, sizeof(tinfl_decompressor));
+		if (state->tinfl == NULL) {
+			SET_ERROR(upng, UPNG_ENOMEM);
+			return 1;
+		}
+		tinfl_init(state->tinfl);
+	}
+
+	do {
+		size_t in_size = (size_t)(s->limit - s->next);
+		size_t out_size = out->size - out->pos;
+		unsigned long slice;
+
+		/* out of budget, the stream goes on with the next call */
+		if (out->base + out->pos >= out->stop) {
+			return 0;
+		}
+
+		/* tinfl cannot stop at a size of a window that wraps, it gets the input in slices instead, each about
+		   enough for half the output still to go */
+		slice = (out->stop - out->base - out->pos) / (2 * state->ratio + 2) + 1;
+		if (in_size > slice) {
+			in_size = slice;
+		}
+
+		status = tinfl_decompress(state->tinfl, s->next, &in_size, out->buffer, out->buffer + out->pos, &out_size, flags);
+		s->next += in_size;
+		out->pos += out_size;
+		/* a few bytes of input say little, tinfl may have had bits of them already: the ratio goes up right away,
+		   but only comes down slowly */
+		if (in_size > 0) {
+			if (out_size / in_size > state->ratio) {
+				state->ratio = out_size / in_size;
+			} else {
+				state->ratio -= (state->ratio - out_size / in_size) / 4;
+			}
+		}
+
+		if (status == TINFL_STATUS_NEEDS_MORE_INPUT) {
+			/* error: the stream continues past the last IDAT chunk */
+			if (s->next == s->limit && !uz_stream_next_chunk(s)) {
+				SET_ERROR(upng, UPNG_EMALFORMED);
+			}
+		} else if (status == TINFL_STATUS_HAS_MORE_OUTPUT) {
+			uz_output_wrap(upng, out);
+		} else if (status < TINFL_STATUS_DONE) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
+		}
+
+		/* pass on completed scanlines after every IDAT payload */
+		uz_output_check(upng, out);
+		if (out->pos - out->flushed >= out->flush_at) {
+			uz_output_flush(upng, out);
+		}
+	} while (status != TINFL_STATUS_DONE && upng->error == UPNG_EOK);
+
+	/* hand on whatever is left in the window */
+	uz_output_flush(upng, out);
+
+	if (upng->error == UPNG_EOK && upng->verify != UPNG_VERIFY_NONE) {
+		uz_check_adler(upng, s, state->tinfl->m_bit_buf, state->tinfl->m_num_bits, out->adler);
+	}
+
+	uz_inflate_release(upng, state);
+
+	return 1;
+}
+#endif
+
+/*inflate the deflated data (cfr. deflate spec), going on from where state (set up with uz_inflate_init) stopped.
+  it stops once the output reaches out->stop; return value is 0 then, to go on with the next call, and 1 once the
+  stream is done or an error occured*/
+static int uz_inflate_run(upng_t* upng, uz_output* out, uz_stream* s, uz_inflate_state* state)
+{
+#ifdef UPNG_TINFL
+	if (upng->inflater == UPNG_INFLATER_TINFL) {
+		return uz_inflate_run_tinfl(upng, out, s, state);
+	}
+#endif
+
+#ifndef UPNG_TINFL_ONLY
+	while (upng->error == UPNG_EOK) {
+		if (state->block == UZ_BLOCK_NONE) {
+			unsigned btype;
+
+			if (state->last) {
+				break;
+			}
+
+			/* out of budget, the next block starts with the next call */
+			if (out->base + out->pos >= out->stop) {
+				return 0;
+			}
+
+			/* read block control bits */
+			state->last = read_bits(upng, s, 1);
+			btype = read_bits(upng, s, 2);
+
+			/* ensure the block header didn't run past the end of the data */
+			if (upng->error != UPNG_EOK) {
+				break;
+			}
+
+			/* process control type appropriateyly */
+			if (btype == 3) {
+				SET_ERROR(upng, UPNG_EMALFORMED);
+				break;
+			} else if (btype == 0) {
+				inflate_uncompressed_begin(upng, out, s, state);	/*no compression */
+			} else {
+				inflate_huffman_begin(upng, s, btype, state);	/*compression, btype 01 or 10 */
+			}
+		}
+
+		if (state->block == UZ_BLOCK_STORED) {
+			inflate_uncompressed(upng, out, s, state);
+		} else if (state->block == UZ_BLOCK_HUFFMAN) {
+			inflate_huffman(upng, out, s, state);
+		}
+
+		/* stop if an error has occured */
+		if (upng->error != UPNG_EOK) {
+			break;
+		}
+
+		/* out of budget in the middle of the block */
+		if (state->block != UZ_BLOCK_NONE) {
+			return 0;
+		}
+
+		uz_output_check(upng, out);
+	}
+
+	uz_inflate_release(upng, state);
+	if (upng->error != UPNG_EOK) {
+		return 1;
+	}
+
+	/* the last block must not have run into the padding after the data */
+	check_bits(upng, s);
+
+	/* hand on whatever is left in the window */
+	uz_output_flush(upng, out);
+
+	if (upng->error == UPNG_EOK && upng->verify != UPNG_VERIFY_NONE) {
+		uz_check_adler(upng, s, s->bitbuf, s->bitcount - s->overrun * 8, out->adler);
+	}
+#endif
+
+	return 1;
+}
+
+/* read and check the zlib header; return value is the size of the LZ77 window the stream was compressed with */
+static unsigned long uz_inflate_header(upng_t* upng, uz_stream* s)
+{
+	unsigned char cmf, flg;
+
+	/* we require two bytes for the zlib data header */
+	cmf = uz_read_byte(upng, s);
+	flg = uz_read_byte(upng, s);
+	if (upng->error != UPNG_EOK) {
+		/* the header was cut short by an IDAT chunk that failed its CRC */
+		if (s->corrupt) {
+			SET_ERROR(upng, UPNG_ECHECKSUM);
+		}
+		return 0;
+	}
+
+	/* 256 * cmf + flg must be a multiple of 31, the FCHECK value is supposed to be made that way */
+	if ((cmf * 256 + flg) % 31 != 0) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return 0;
+	}
+
+	/*error: only compression method 8: inflate with sliding window of 32k is supported by the PNG spec */
+	if ((cmf & 15) != 8 || ((cmf >> 4) & 15) > 7) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return 0;
+	}
+
+	/* the specification of PNG says about the zlib stream: "The additional flags shall not specify a preset dictionary." */
+	if (((flg >> 5) & 1) != 0) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return 0;
+	}
+
+	return 1UL << (((cmf >> 4) & 15) + 8);
+}
+
+/* inflate the stream following the zlib header into out, which must hold all of it */
+static upng_error uz_inflate(upng_t* upng, unsigned char *out, unsigned long outsize, uz_stream* s)
+{
+	uz_output output;
+	uz_inflate_state state;
+
+	/* the output buffer holds the whole stream, so it never wraps */
+	output.buffer = out;
+	output.size = outsize;
+	output.pos = 0;
+	output.base = 0;
+	output.limit = outsize;
+	output.flushed = 0;
+	output.flush_at = ULONG_MAX;
+	output.stop = ULONG_MAX;
+	output.adler = 1;
+	output.checked = 0;
+	output.scanlines = NULL;
+
+	uz_inflate_init(&state);
+	uz_inflate_run(upng, &output, s, &state);
+
+	return upng->error;
+}
+
+/*Paeth predicter, used by PNG filter type 4*/
+static int paeth_predictor(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = p > a ? p - a : a - p;
+	int pb = p > b ? p - b : b - p;
+	int pc = p > c ? p - c : c - p;
+
+	if (pa <= pb && pa <= pc)
+		return a;
+	else if (pb <= pc)
+		return b;
+	else
+		return c;
+}
+
+/* vector kernels for unfilter_scanline, SSE2 on the host; the watch (a Cortex-M3) takes the scalar loops.
+   Up works on whole vectors. the other filters depend on the pixel to the left, so they work a pixel at a time in
+   one 32-bit lane, for pixels of 3 and 4 bytes; the bytes of a pixel are independent of each other. Sub also
+   does a whole vector at a time for pixels of 1, 2, 4 and 8 bytes with a prefix sum. everything else takes the
+   scalar loops. the lane loops are instantiated for pixels of 3 and 4 bytes each, which only gives fixed size loads
+   and stores if everything gets inlined, -Os or not */
+#define LANE_INLINE __attribute__((always_inline))
+
+#if defined(__SSE2__)
+#define UPNG_SIMD_LANES 1
+#define UPNG_SIMD_PAETH 1
+typedef __m128i upng_lane;
+
+static inline LANE_INLINE upng_lane lane_load(const unsigned char* p, unsigned long bytewidth)
+{
+	int v = 0;
+	memcpy(&v, p, bytewidth);
+	return _mm_cvtsi32_si128(v);
+}
+
+static inline LANE_INLINE void lane_store(unsigned char* p, upng_lane lane, unsigned long bytewidth)
+{
+	int v = _mm_cvtsi128_si32(lane);
+	memcpy(p, &v, bytewidth);
+}
+
+static inline LANE_INLINE upng_lane lane_add(upng_lane a, upng_lane b)
+{
+	return _mm_add_epi8(a, b);
+}
+
+/* (a + b) / 2 rounded down, pavgb rounds up */
+static inline LANE_INLINE upng_lane lane_avg(upng_lane a, upng_lane b)
+{
+	return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+static inline LANE_INLINE __m128i abs_epi16(__m128i x)
+{
+#if defined(__SSSE3__)
+	return _mm_abs_epi16(x);
+#else
+	return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+#endif
+}
+
+/* paeth_predictor for each byte, in 16-bit lanes as the distances need 9 bits */
+static inline LANE_INLINE upng_lane lane_paeth(upng_lane a, upng_lane b, upng_lane c)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i a16 = _mm_unpacklo_epi8(a, zero);
+	__m128i b16 = _mm_unpacklo_epi8(b, zero);
+	__m128i c16 = _mm_unpacklo_epi8(c, zero);
+	__m128i pa = _mm_sub_epi16(b16, c16);
+	__m128i pb = _mm_sub_epi16(a16, c16);
+	__m128i pc = abs_epi16(_mm_add_epi16(pa, pb));
+	__m128i use_b, use_c, pred;
+
+	pa = abs_epi16(pa);
+	pb = abs_epi16(pb);
+
+	/* a if pa <= pb and pa <= pc, else b if pb <= pc, else c */
+	use_c = _mm_and_si128(_mm_cmpgt_epi16(pb, pc), _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc)));
+	use_b = _mm_andnot_si128(use_c, _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc)));
+	pred = _mm_or_si128(_mm_and_si128(use_c, c16), _mm_andnot_si128(use_c, _mm_or_si128(_mm_and_si128(use_b, b16), _mm_andnot_si128(use_b, a16))));
+	return _mm_packus_epi16(pred, pred);
+}
+#endif
+
+/* filter type 2, Up: every byte only depends on the one above it */
+static void unfilter_up(unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long length)
+{
+	unsigned long i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 16 <= length; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(precon + i));
+		_mm_storeu_si128((__m128i*)(recon + i), _mm_add_epi8(x, b));
+	}
+#endif
+
+	for (; i < length; i++)
+		recon[i] = scanline[i] + precon[i];
+}
+
+#if defined(__SSE2__)
+/* Sub for pixels of bw = 1, 2, 4 or 8 bytes, a vector at a time: the last pixel of the previous vector is added to
+   the first one, then a prefix sum with shifts of bw, 2bw, 4bw and 8bw bytes adds every pixel to the ones after it.
+   return value is the number of bytes done */
+#define UNFILTER_SUB_SSE2(bw) \
+	for (; i + 16 <= length; i += 16) { \
+		__m128i x = _mm_loadu_si128((const __m128i*)(scanline + i)); \
+		x = _mm_add_epi8(x, _mm_srli_si128(last, 16 - (bw))); \
+		x = _mm_add_epi8(x, _mm_slli_si128(x, (bw))); \
+		if ((bw) < 8) x = _mm_add_epi8(x, _mm_slli_si128(x, 2 * (bw))); \
+		if ((bw) < 4) x = _mm_add_epi8(x, _mm_slli_si128(x, 4 * (bw))); \
+		if ((bw) < 2) x = _mm_add_epi8(x, _mm_slli_si128(x, 8 * (bw))); \
+		_mm_storeu_si128((__m128i*)(recon + i), x); \
+		last = x; \
+	}
+
+static unsigned long unfilter_sub_sse2(unsigned char *recon, const unsigned char *scanline, unsigned long bytewidth, unsigned long length)
+{
+	__m128i last = _mm_setzero_si128();
+	unsigned long i = 0;
+
+	switch (bytewidth) {
+	case 1:
+		UNFILTER_SUB_SSE2(1)
+		break;
+	case 2:
+		UNFILTER_SUB_SSE2(2)
+		break;
+	case 4:
+		UNFILTER_SUB_SSE2(4)
+		break;
+	case 8:
+		UNFILTER_SUB_SSE2(8)
+		break;
+	}
+
+	return i;
+}
+#endif
+
+#if defined(UPNG_SIMD_LANES)
+/* the lane loops continue at byte i, once the first pixel is done; return value is the number of bytes done.
+   loads take a whole word, for 3 byte pixels the fourth lane just carries along a byte of the next pixel */
+static inline LANE_INLINE unsigned long unfilter_sub_lanes(unsigned char *recon, const unsigned char *scanline, unsigned long i, unsigned long length, unsigned long bytewidth)
+{
+	upng_lane a = lane_load(recon + i - bytewidth, bytewidth);
+
+	for (; i + 4 <= length; i += bytewidth) {
+		a = lane_add(a, lane_load(scanline + i, 4));
+		lane_store(recon + i, a, bytewidth);
+	}
+
+	return i;
+}
+
+static inline LANE_INLINE unsigned long unfilter_avg_lanes(unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long i, unsigned long length, unsigned long bytewidth)
+{
+	upng_lane a = lane_load(recon + i - bytewidth, bytewidth);
+
+	for (; i + 4 <= length; i += bytewidth) {
+		a = lane_add(lane_load(scanline + i, 4), lane_avg(a, lane_load(precon + i, 4)));
+		lane_store(recon + i, a, bytewidth);
+	}
+
+	return i;
+}
+#endif
+
+#if defined(UPNG_SIMD_PAETH)
+static inline LANE_INLINE unsigned long unfilter_paeth_lanes(unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long i, unsigned long length, unsigned long bytewidth)
+{
+	upng_lane a = lane_load(recon + i - bytewidth, bytewidth);
+	upng_lane c = lane_load(precon + i - bytewidth, bytewidth);
+
+	for (; i + 4 <= length; i += bytewidth) {
+		upng_lane b = lane_load(precon + i, 4);
+		a = lane_add(lane_load(scanline + i, 4), lane_paeth(a, b, c));
+		lane_store(recon + i, a, bytewidth);
+		c = b;
+	}
+
+	return i;
+}
+#endif
+
+/* filter type 1, Sub */
+static void unfilter_sub(unsigned char *recon, const unsigned char *scanline, unsigned long bytewidth, unsigned long length)
+{
+	unsigned long i = 0;
+
+	/* the vectors start from the first pixel themselves, reading it before anything is written */
+#if defined(__SSE2__)
+	if (length >= 16 && (bytewidth & (bytewidth - 1)) == 0) {
+		i = unfilter_sub_sse2(recon, scanline, bytewidth, length);
+	}
+#endif
+
+	for (; i < bytewidth && i < length; i++)
+		recon[i] = scanline[i];
+#if defined(UPNG_SIMD_LANES)
+	if (bytewidth == 3) {
+		i = unfilter_sub_lanes(recon, scanline, i, length, 3);
+	} else if (bytewidth == 4) {
+		i = unfilter_sub_lanes(recon, scanline, i, length, 4);
+	}
+#endif
+
+	for (; i < length; i++)
+		recon[i] = scanline[i] + recon[i - bytewidth];
+}
+
+/* filter type 3, Average, with a previous scanline */
+static void unfilter_avg(unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long bytewidth, unsigned long length)
+{
+	unsigned long i;
+
+	for (i = 0; i < bytewidth && i < length; i++)
+		recon[i] = scanline[i] + precon[i] / 2;
+
+#if defined(UPNG_SIMD_LANES)
+	if (bytewidth == 3) {
+		i = unfilter_avg_lanes(recon, scanline, precon, i, length, 3);
+	} else if (bytewidth == 4) {
+		i = unfilter_avg_lanes(recon, scanline, precon, i, length, 4);
+	}
+#endif
+
+	for (; i < length; i++)
+		recon[i] = scanline[i] + ((recon[i - bytewidth] + precon[i]) / 2);
+}
+
+/* filter type 4, Paeth, with a previous scanline */
+static void unfilter_paeth(unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long bytewidth, unsigned long length)
+{
+	unsigned long i;
+
+	for (i = 0; i < bytewidth && i < length; i++)
+		recon[i] = (unsigned char)(scanline[i] + precon[i]);
+
+#if defined(UPNG_SIMD_PAETH)
+	if (bytewidth == 3) {
+		i = unfilter_paeth_lanes(recon, scanline, precon, i, length, 3);
+	} else if (bytewidth == 4) {
+		i = unfilter_paeth_lanes(recon, scanline, precon, i, length, 4);
+	}
+#endif
+
+	for (; i < length; i++)
+		recon[i] = (unsigned char)(scanline[i] + paeth_predictor(recon[i - bytewidth], precon[i], precon[i - bytewidth]));
+}
+
+static void unfilter_scanline(upng_t* upng, unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long bytewidth, unsigned char filterType, unsigned long length)
+{
+	/*
+	   For PNG filter method 0
+	   unfilter a PNG image scanline by scanline. when the pixels are smaller than 1 byte, the filter works byte per byte (bytewidth = 1)
+	   precon is the previous unfiltered scanline, recon the result, scanline the current one
+	   the incoming scanlines do NOT include the filtertype byte, that one is given in the parameter filterType instead
+	   recon and scanline MAY be the same memory address, or recon may start before scanline! precon must be disjoint.
+	 */
+
+	unsigned long i;
+	switch (filterType) {
+	case 0:
+		for (i = 0; i < length; i++)
+			recon[i] = scanline[i];
+		break;
+	case 1:
+		unfilter_sub(recon, scanline, bytewidth, length);
+		break;
+	case 2:
+		if (precon)
+			unfilter_up(recon, scanline, precon, length);
+		else
+			for (i = 0; i < length; i++)
+				recon[i] = scanline[i];
+		break;
+	case 3:
+		if (precon) {
+			unfilter_avg(recon, scanline, precon, bytewidth, length);
+		} else {
+			for (i = 0; i < bytewidth; i++)
+				recon[i] = scanline[i];
+			for (i = bytewidth; i < length; i++)
+				recon[i] = scanline[i] + recon[i - bytewidth] / 2;
+		}
+		break;
+	case 4:
+		if (precon) {
+			unfilter_paeth(recon, scanline, precon, bytewidth, length);
+		} else {
+			/* without a previous scanline paeth always predicts the left pixel, like Sub */
+			unfilter_sub(recon, scanline, bytewidth, length);
+		}
+		break;
+	default:
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		break;
+	}
+}
+
+static void unfilter(upng_t* upng, unsigned char *out, const unsigned char *in, unsigned w, unsigned h, unsigned bpp)
+{
+	/*
+	   For PNG filter method 0
+	   this function unfilters a single image (e.g. without interlacing this is called once, with Adam7 it's called 7 times)
+	   out must have enough bytes allocated already, in must have the scanlines + 1 filtertype byte per scanline
+	   w and h are image dimensions or dimensions of reduced image, bpp is bpp per pixel
+	   in and out are allowed to be the same memory address!
+	 */
+
+	unsigned y;
+	unsigned char *prevline = 0;
+
+	unsigned long bytewidth = (bpp + 7) / 8;	/*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise */
+	unsigned long linebytes = (w * bpp + 7) / 8;
+
+	for (y = 0; y < h; y++) {
+		unsigned long outindex = linebytes * y;
+		unsigned long inindex = (1 + linebytes) * y;	/*the extra filterbyte added to each row */
+		unsigned char filterType = in[inindex];
+
+		unfilter_scanline(upng, &out[outindex], &in[inindex + 1], prevline, bytewidth, filterType, linebytes);
+		if (upng->error != UPNG_EOK) {
+			return;
+		}
+
+		prevline = &out[outindex];
+	}
+}
+
+static void remove_padding_bits(unsigned char *out, const unsigned char *in, unsigned long olinebits, unsigned long ilinebits, unsigned h)
+{
+	/*
+	   After filtering there are still padding bpp if scanlines have non multiple of 8 bit amounts. They need to be removed (except at last scanline of (Adam7-reduced) image) before working with pure image buffers for the Adam7 code, the color convert code and the output to the user.
+	   in and out are allowed to be the same buffer, in may also be higher but still overlapping; in must have >= ilinebits*h bpp, out must have >= olinebits*h bpp, olinebits must be <= ilinebits
+	   also used to move bpp after earlier such operations happened, e.g. in a sequence of reduced images from Adam7
+	   only useful if (ilinebits - olinebits) is a value in the range 1..7
+	 */
+	unsigned y;
+	unsigned long diff = ilinebits - olinebits;
+	unsigned long obp = 0, ibp = 0;	/*bit pointers */
+	for (y = 0; y < h; y++) {
+		unsigned long x;
+		for (x = 0; x < olinebits; x++) {
+			unsigned char bit = (unsigned char)((in[(ibp) >> 3] >> (7 - ((ibp) & 0x7))) & 1);
+			ibp++;
+
+			if (bit == 0)
+				out[(obp) >> 3] &= (unsigned char)(~(1 << (7 - ((obp) & 0x7))));
+			else
+				out[(obp) >> 3] |= (1 << (7 - ((obp) & 0x7)));
+			++obp;
+		}
+		ibp += diff;
+	}
+}
+
+/* pixels or scanlines of an Adam7 pass through an image that is size pixels wide or high */
+static unsigned adam7_count(unsigned size, unsigned start, unsigned step)
+{
+	return (size + step - start - 1) / step;
+}
+
+/* channels of the image as stored, before alpha is composited */
+static unsigned upng_source_components(const upng_t* upng)
+{
+	switch (upng->color_type) {
+	case UPNG_LUM:
+	case UPNG_PLT:
+		return 1;
+	case UPNG_RGB:
+		return 3;
+	case UPNG_LUMA:
+		return 2;
+	case UPNG_RGBA:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+static unsigned upng_source_bpp(const upng_t* upng)
+{
+	return upng->color_depth * upng_source_components(upng);
+}
+
+/* alpha is composited while decoding, leaving a single gray channel of the same depth */
+static int upng_composited(const upng_t* upng)
+{
+	return upng->background >= 0 && (upng->color_type == UPNG_LUMA || upng->color_type == UPNG_RGBA);
+}
+
+/* size of the inflated image data: a filter type byte and the scanline for every scanline of every pass */
+static unsigned long upng_inflated_size(const upng_t* upng)
+{
+	unsigned bpp = upng_source_bpp(upng);
+	unsigned long size = 0;
+	unsigned pass;
+
+	if (!upng->interlace) {
+		return upng->height * (((upng->width * bpp + 7) / 8) + 1);
+	}
+
+	/* passes without pixels have no scanlines at all, not even filter type bytes */
+	for (pass = 0; pass < 7; pass++) {
+		unsigned long w = adam7_count(upng->width, ADAM7_IX[pass], ADAM7_DX[pass]);
+		unsigned long h = adam7_count(upng->height, ADAM7_IY[pass], ADAM7_DY[pass]);
+		if (w != 0 && h != 0) {
+			size += h * (((w * bpp + 7) / 8) + 1);
+		}
+	}
+
+	return size;
+}
+
+/* size of the decoded image: the size in the header, or scaled down to fit the bounds set with upng_set_scale,
+   keeping the aspect ratio; images are never scaled up */
+static void upng_scaled_size(const upng_t* upng, unsigned* width, unsigned* height)
+{
+	*width = upng->width;
+	*height = upng->height;
+
+	if (upng->scale_width == 0 || (upng->width <= upng->scale_width && upng->height <= upng->scale_height)) {
+		return;
+	}
+
+	if ((unsigned long long)upng->width * upng->scale_height > (unsigned long long)upng->height * upng->scale_width) {
+		*width = upng->scale_width;
+		*height = (unsigned)((unsigned long long)upng->height * upng->scale_width / upng->width);
+	} else {
+		*height = upng->scale_height;
+		*width = (unsigned)((unsigned long long)upng->width * upng->scale_height / upng->height);
+	}
+
+	if (*width == 0) {
+		*width = 1;
+	}
+	if (*height == 0) {
+		*height = 1;
+	}
+}
+
+/* size of the image buffer: the pixels without padding between rows, or both bit planes */
+static unsigned long upng_image_size(const upng_t* upng)
+{
+	unsigned width, height;
+
+	upng_scaled_size(upng, &width, &height);
+	if (upng->output == UPNG_OUTPUT_PLANES) {
+		return 2 * height * (unsigned long)UPNG_PLANE_STRIDE;
+	} else if (upng->output == UPNG_OUTPUT_LEVELS) {
+		return (height * width * 2 + 7) / 8;
+	}
+
+	return (height * width * upng_get_bpp(upng) + 7) / 8;
+}
+
+/* set up the size of rows->pass, skipping the passes that have no pixels; rows->pass is rows->passes once all passes are done */
+static void upng_scanlines_pass(upng_t* upng, upng_scanlines* rows)
+{
+	for (; rows->pass < rows->passes; rows->pass++) {
+		if (rows->passes == 1) {
+			rows->width = upng->width;
+			rows->height = upng->height;
+		} else {
+			rows->width = adam7_count(upng->width, ADAM7_IX[rows->pass], ADAM7_DX[rows->pass]);
+			rows->height = adam7_count(upng->height, ADAM7_IY[rows->pass], ADAM7_DY[rows->pass]);
+		}
+
+		if (rows->width != 0 && rows->height != 0) {
+			break;
+		}
+	}
+
+	rows->linebytes = (rows->width * rows->bpp + 7) / 8;
+	rows->previous = NULL;
+	rows->y = 0;
+}
+
+static void upng_scanlines_init(upng_t* upng, upng_scanlines* rows)
+{
+	rows->bpp = upng_source_bpp(upng);
+	rows->bytewidth = (rows->bpp + 7) / 8;
+	rows->lines = NULL;
+	rows->image = NULL;
+	rows->stride = 0;
+	rows->fill = 0;
+	rows->pass = 0;
+	rows->passes = upng->interlace ? 7 : 1;
+	rows->stable = 0;
+	rows->preview = 0;
+	rows->levels = upng->output != UPNG_OUTPUT_NATIVE;
+	rows->planes = upng->output == UPNG_OUTPUT_PLANES;
+	rows->dither = upng->interlace && upng->dither == UPNG_DITHER_DIFFUSION ? UPNG_DITHER_ORDERED : upng->dither;
+	rows->errors = NULL;
+	rows->out = NULL;
+	rows->palette = upng->color_type == UPNG_PLT ? upng->palette : NULL;
+	upng_scaled_size(upng, &rows->image_width, &rows->image_height);
+	rows->sums = NULL;
+	rows->autolevels = rows->levels && upng->levels != UPNG_LEVELS_FIXED && upng->color_depth > 2;
+	rows->histogram = NULL;
+	rows->delay = NULL;
+	rows->delayed = 0;
+	rows->delay_rows = 1;
+	if (rows->image_width != 0 && rows->image_width < UPNG_LEVELS_DELAY) {
+		rows->delay_rows = UPNG_LEVELS_DELAY / rows->image_width;
+	}
+	rows->tone = NULL;
+	rows->composite = upng_composited(upng);
+	rows->gray = NULL;
+	upng->cut_gray = 64;
+	upng->cut_white = 192;
+	rows->callback = NULL;
+	rows->pass_callback = NULL;
+	rows->user = NULL;
+	upng_scanlines_pass(upng, rows);
+}
+
+static void upng_scanlines_free(upng_t* upng, upng_scanlines* rows)
+{
+	upng_dealloc(upng, rows->lines);
+	upng_dealloc(upng, rows->sums);
+	upng_dealloc(upng, rows->errors);
+	upng_dealloc(upng, rows->out);
+	upng_dealloc(upng, rows->histogram);
+	upng_dealloc(upng, rows->delay);
+	upng_dealloc(upng, rows->tone);
+	upng_dealloc(upng, rows->gray);
+}
+
+/* buffer for scanline y, with room for the filter type byte; the two buffers are only allocated once a
+   scanline has to be assembled or unfiltered, and scanlines alternate between them so the previous one stays intact.
+   they are sized for full scanlines, which no Adam7 pass is wider than */
+static unsigned char* upng_scanlines_line(upng_t* upng, upng_scanlines* rows, unsigned y)
+{
+	unsigned long stride = (upng->width * rows->bpp + 7) / 8 + 1;
+
+	if (rows->lines == NULL) {
+		rows->lines = (unsigned char*)upng_alloc(upng, 2 * stride);
+		if (rows->lines == NULL) {
+			SET_ERROR(upng, UPNG_ENOMEM);
+			return NULL;
+		}
+	}
+
+	return rows->lines + (y & 1) * stride;
+}
+
+/* byte i of an unfiltered scanline, with indices turned into gray levels when palette is set */
+#define upng_scanlines_byte(palette, row, i) ((palette) != NULL ? (palette)[(row)[i]] : (row)[i])
+
+static void upng_palette_map(unsigned char* out, const unsigned char* row, unsigned long length, const unsigned char* palette)
+{
+	unsigned long i;
+	for (i = 0; i < length; i++) {
+		out[i] = palette[row[i]];
+	}
+}
+
+/* sample i of an unfiltered scanline with samples of depth bits */
+static unsigned upng_sample_get(const unsigned char* palette, const unsigned char* row, unsigned long i, unsigned depth)
+{
+	unsigned long bit = i * depth;
+
+	if (depth == 16) {
+		return (unsigned)row[i * 2] << 8 | row[i * 2 + 1];
+	} else if (depth == 8) {
+		return upng_scanlines_byte(palette, row, i);
+	}
+
+	return (upng_scanlines_byte(palette, row, bit >> 3) >> (8 - depth - (bit & 7))) & ((1u << depth) - 1);
+}
+
+static void upng_sample_put(unsigned char* out, unsigned long i, unsigned depth, unsigned value)
+{
+	unsigned long bit = i * depth;
+	unsigned shift;
+
+	if (depth == 16) {
+		out[i * 2] = (unsigned char)(value >> 8);
+		out[i * 2 + 1] = (unsigned char)value;
+	} else if (depth == 8) {
+		out[i] = (unsigned char)value;
+	} else {
+		shift = 8 - depth - (unsigned)(bit & 7);
+		out[bit >> 3] = (unsigned char)((out[bit >> 3] & ~(((1u << depth) - 1) << shift)) | (value << shift));
+	}
+}
+
+/* black, gray and white as UPNG_OUTPUT_LEVELS values, and the luma they stand for when diffusing the error */
+static const unsigned char LEVEL_VALUE[3] = { 0, 2, 3 };
+static const int LEVEL_LUMA[3] = { 0, 128, 255 };
+
+/* 4x4 Bayer matrix for ordered dithering */
+static const unsigned char BAYER[4][4] = {
+	{ 0, 8, 2, 10 }, { 12, 4, 14, 6 }, { 3, 11, 1, 9 }, { 15, 7, 13, 5 }
+};
+
+/* gray level of pixel x: images of 1 and 2 bits are taken as they are, with both middle values of 2 bit images
+   gray like the viewer has always drawn them, and 1 bit images without gray. deeper images return -1 and the luma
+   of the pixel, from integer weights for color images */
+static int upng_pixel_level(const upng_t* upng, const unsigned char* palette, const unsigned char* row, unsigned long x, unsigned* luma)
+{
+	unsigned channels = upng_get_components(upng);
+	unsigned depth = upng->color_depth;
+	unsigned value = upng_sample_get(palette, row, x * channels, depth);
+
+	if (depth == 1) {
+		return value ? 2 : 0;
+	} else if (depth == 2) {
+		return value == 0 ? 0 : value == 3 ? 2 : 1;
+	}
+
+	if (channels >= 3) {
+		unsigned g = upng_sample_get(palette, row, x * channels + 1, depth);
+		unsigned b = upng_sample_get(palette, row, x * channels + 2, depth);
+		if (depth == 16) {
+			value >>= 8;
+			g >>= 8;
+			b >>= 8;
+		}
+		*luma = (77 * value + 150 * g + 29 * b + 128) >> 8;
+	} else if (depth == 16) {
+		*luma = value >> 8;
+	} else if (depth == 4) {
+		*luma = value * 17;
+	} else {
+		*luma = value;
+	}
+
+	return -1;
+}
+
+/* gray level of luma at pixel x, y with ordered dithering, or the nearest one without dithering */
+static unsigned upng_level_ordered(const upng_scanlines* rows, unsigned luma, unsigned long x, unsigned long y)
+{
+	unsigned threshold = rows->dither == UPNG_DITHER_ORDERED ? 2 * BAYER[y & 3][x & 3] + 1 : 16;
+
+	if (luma < 128) {
+		return luma * 32 >= threshold * 128 ? 1 : 0;
+	}
+	return (luma - 128) * 32 >= threshold * 127 ? 2 : 1;
+}
+
+/* start of row y of the image, each row being linebytes bytes in the image buffer's own layout */
+static unsigned char* upng_image_row(const upng_scanlines* rows, unsigned long y, unsigned long linebytes)
+{
+	return rows->image + y * (rows->stride != 0 ? rows->stride : linebytes);
+}
+
+/* set sample i of row y of the image, each row being samples samples of depth bits: the image buffer has no padding
+   bits between rows, with a stride every row starts on a byte of its own */
+static void upng_image_put(const upng_scanlines* rows, unsigned long y, unsigned long samples, unsigned long i, unsigned depth, unsigned value)
+{
+	if (rows->stride != 0) {
+		upng_sample_put(rows->image + y * rows->stride, i, depth, value);
+	} else {
+		upng_sample_put(rows->image, y * samples + i, depth, value);
+	}
+}
+
+/* set the pixels of a block of w by h pixels at px, py to a gray level: in the white and gray planes, whose bits are in
+   framebuffer order, least significant bit first, or as UPNG_OUTPUT_LEVELS values */
+static void upng_levels_put(upng_scanlines* rows, unsigned long px, unsigned long py, unsigned w, unsigned h, unsigned level)
+{
+	unsigned long stride = rows->stride != 0 ? rows->stride : UPNG_PLANE_STRIDE;
+	unsigned char* white = rows->image + py * stride;
+	unsigned char* gray = white + rows->image_height * stride;
+	unsigned x, y;
+
+	for (y = 0; y < h; y++, white += stride, gray += stride) {
+		for (x = px; x < px + w; x++) {
+			unsigned char bit = (unsigned char)(1 << (x & 7));
+			if (!rows->planes) {
+				upng_image_put(rows, py + y, rows->image_width, x, 2, LEVEL_VALUE[level]);
+				continue;
+			}
+			white[x >> 3] = (unsigned char)((white[x >> 3] & ~bit) | (level == 2 ? bit : 0));
+			gray[x >> 3] = (unsigned char)((gray[x >> 3] & ~bit) | (level == 1 ? bit : 0));
+		}
+	}
+}
+
+/* pick the cut points for auto levels from the histogram and set up rows->tone, which stretches luma so they land on the
+   fixed cut points, 64 and 192; images too flat to split keep the fixed ones */
+static int upng_levels_pick(upng_t* upng, upng_scanlines* rows)
+{
+	const unsigned long* histogram = rows->histogram;
+	unsigned long total = 0, sum = 0, count;
+	unsigned i, v;
+
+	for (i = 0; i < 64; i++) {
+		total += histogram[i];
+		sum += histogram[i] * i;
+	}
+
+	if (upng->levels == UPNG_LEVELS_OTSU) {
+		/* the split into bins [0, a), [a, b) and [b, 64) with the largest variance between the three, which is the
+		   one with the largest sum of squared bin sums over bin counts. the middle one may be empty */
+		unsigned long long best = 0;
+		unsigned long w0 = 0, s0 = 0;
+		unsigned a, b;
+
+		for (a = 1; a < 63; a++) {
+			unsigned long w1 = 0, s1 = 0;
+
+			w0 += histogram[a - 1];
+			s0 += histogram[a - 1] * (a - 1);
+			if (w0 == 0) {
+				continue;
+			}
+
+			for (b = a + 1; b < 64; b++) {
+				unsigned long w2, s2;
+				unsigned long long between;
+
+				w1 += histogram[b - 1];
+				s1 += histogram[b - 1] * (b - 1);
+				w2 = total - w0 - w1;
+				s2 = sum - s0 - s1;
+				if (w2 == 0) {
+					break;
+				}
+
+				between = (unsigned long long)s0 * s0 / w0 + (unsigned long long)s2 * s2 / w2;
+				if (w1 != 0) {
+					between += (unsigned long long)s1 * s1 / w1;
+				}
+				if (between > best) {
+					best = between;
+					upng->cut_gray = a * 4;
+					upng->cut_white = b * 4;
+				}
+			}
+		}
+	} else {
+		/* the lumas the darkest and the lightest 1% of the pixels go past */
+		unsigned lo = 0, hi = 63;
+
+		for (count = 0; lo < 63 && (count += histogram[lo]) <= total / 100; lo++);
+		for (count = 0; hi > 0 && (count += histogram[hi]) <= total / 100; hi--);
+
+		if (hi * 4 + 3 >= lo * 4 + 16) {
+			unsigned range = hi * 4 + 4 - lo * 4;
+			upng->cut_gray = lo * 4 + range / 4;
+			upng->cut_white = lo * 4 + range * 3 / 4;
+		}
+	}
+
+	rows->tone = (unsigned char*)upng_alloc(upng, 256);
+	if (rows->tone == NULL) {
+		SET_ERROR(upng, UPNG_ENOMEM);
+		return 0;
+	}
+
+	for (v = 0; v < 256; v++) {
+		if (v < upng->cut_gray) {
+			rows->tone[v] = (unsigned char)(v * 64 / upng->cut_gray);
+		} else if (v < upng->cut_white) {
+			rows->tone[v] = (unsigned char)(64 + (v - upng->cut_gray) * 128 / (upng->cut_white - upng->cut_gray));
+		} else {
+			rows->tone[v] = (unsigned char)(192 + (v - upng->cut_white) * 63 / (255 - upng->cut_white));
+		}
+	}
+
+	upng_dealloc(upng, rows->histogram);
+	rows->histogram = NULL;
+	return 1;
+}
+
+/* with auto levels, the histogram and the luma held back until the cut points are picked, allocated when first needed */
+static int upng_levels_alloc(upng_t* upng, upng_scanlines* rows, unsigned long size)
+{
+	if (rows->histogram == NULL) {
+		rows->histogram = (unsigned long*)upng_calloc(upng, 64, sizeof(unsigned long));
+		rows->delay = (unsigned char*)upng_alloc(upng, size);
+		if (rows->histogram == NULL || rows->delay == NULL) {
+			SET_ERROR(upng, UPNG_ENOMEM);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* turn output scanline y into gray levels and pass it on, from row or from the luma held back for auto levels.
+   error diffusion is Floyd-Steinberg, with the error for the next scanline kept in a single row; palette is set while
+   row still holds indices */
+static void upng_levels_dither(upng_t* upng, upng_scanlines* rows, const unsigned char* row, const unsigned char* palette, const unsigned char* lumas, unsigned long y)
+{
+	unsigned long width = rows->image_width;
+	int carry = 0, below = 0;
+	unsigned long x;
+
+	if (rows->callback != NULL && rows->out == NULL) {
+		rows->out = (unsigned char*)upng_alloc(upng, (width * 2 + 7) / 8);
+		if (rows->out == NULL) {
+			SET_ERROR(upng, UPNG_ENOMEM);
+			return;
+		}
+	}
+
+	if (rows->dither == UPNG_DITHER_DIFFUSION && rows->errors == NULL) {
+		rows->errors = (short*)upng_calloc(upng, width + 2, sizeof(short));
+		if (rows->errors == NULL) {
+			SET_ERROR(upng, UPNG_ENOMEM);
+			return;
+		}
+	}
+
+	for (x = 0; x < width; x++) {
+		unsigned luma = lumas != NULL ? lumas[x] : 0;
+		int level = lumas != NULL ? -1 : upng_pixel_level(upng, palette, row, x, &luma);
+
+		if (level < 0 && rows->tone != NULL) {
+			luma = rows->tone[luma];
+		}
+
+		if (level < 0 && rows->dither == UPNG_DITHER_DIFFUSION) {
+			/* errors[x + 1] is pixel x of this scanline until it is used, then of the next one */
+			int value = (int)luma + carry + rows->errors[x + 1];
+			int error;
+
+			level = value < 64 ? 0 : value < 192 ? 1 : 2;
+			error = value - LEVEL_LUMA[level];
+			rows->errors[x] = (short)(rows->errors[x] + error * 3 / 16);
+			rows->errors[x + 1] = (short)(below + error * 5 / 16);
+			below = error / 16;
+			carry = error * 7 / 16;
+		} else if (level < 0) {
+			level = (int)upng_level_ordered(rows, luma, x, y);
+		}
+
+		if (rows->callback != NULL) {
+			upng_sample_put(rows->out, x, 2, LEVEL_VALUE[level]);
+		} else {
+			upng_levels_put(rows, x, y, 1, 1, (unsigned)level);
+		}
+	}
+
+	if (rows->callback != NULL) {
+		rows->callback(rows->user, (unsigned)y, rows->out, (width * 2 + 7) / 8);
+	}
+}
+
+/* turn output scanline y into gray levels. with auto levels the first scanlines are held back and counted in the
+   histogram; once as many as fit are in, or the image ends, the cut points are picked and they are passed on */
+static void upng_scanlines_levels(upng_t* upng, upng_scanlines* rows, const unsigned char* row, const unsigned char* palette, unsigned long y)
+{
+	unsigned long width = rows->image_width;
+	unsigned char* lumas;
+	unsigned long x;
+	unsigned d;
+
+	if (!rows->autolevels || rows->tone != NULL) {
+		upng_levels_dither(upng, rows, row, palette, NULL, y);
+		return;
+	}
+
+	if (!upng_levels_alloc(upng, rows, width * rows->delay_rows)) {
+		return;
+	}
+
+	lumas = rows->delay + rows->delayed * width;
+	for (x = 0; x < width; x++) {
+		unsigned luma = 0;
+		upng_pixel_level(upng, palette, row, x, &luma);
+		lumas[x] = (unsigned char)luma;
+		rows->histogram[luma >> 2]++;
+	}
+
+	if (++rows->delayed < rows->delay_rows && y + 1 < rows->image_height) {
+		return;
+	}
+
+	if (!upng_levels_pick(upng, rows)) {
+		return;
+	}
+
+	for (d = 0; d < rows->delayed && upng->error == UPNG_EOK; d++) {
+		upng_levels_dither(upng, rows, NULL, NULL, rows->delay + d * width, y + 1 - rows->delayed + d);
+	}
+	upng_dealloc(upng, rows->delay);
+	rows->delay = NULL;
+}
+
+/* pass output scanline y on as it is: into the image, or to the row callback. palette is set while row still holds
+   indices */
+static void upng_scanlines_native(upng_t* upng, upng_scanlines* rows, const unsigned char* row, const unsigned char* palette, unsigned long y)
+{
+	unsigned long samples = rows->image_width * upng_get_components(upng);
+	unsigned long linebytes = (samples * upng->color_depth + 7) / 8;
+	unsigned char* line;
+	unsigned long i;
+
+	if (rows->image != NULL && rows->stride == 0 && samples * upng->color_depth != linebytes * 8) {
+		for (i = 0; i < samples; i++) {
+			upng_image_put(rows, y, samples, i, upng->color_depth, upng_sample_get(palette, row, i, upng->color_depth));
+		}
+	} else if (rows->image != NULL && palette != NULL) {
+		upng_palette_map(upng_image_row(rows, y, linebytes), row, linebytes, palette);
+	} else if (rows->image != NULL) {
+		memcpy(upng_image_row(rows, y, linebytes), row, linebytes);
+	} else if (palette != NULL) {
+		/* the indices stay as they are for unfiltering the next scanline; the gray levels go into the
+		   buffer that scanline will use, which holds nothing that is still needed */
+		line = upng_scanlines_line(upng, rows, rows->y + 1);
+		if (line == NULL) {
+			return;
+		}
+
+		upng_palette_map(line + 1, row, linebytes, palette);
+		rows->callback(rows->user, (unsigned)y, line + 1, linebytes);
+	} else {
+		rows->callback(rows->user, (unsigned)y, row, linebytes);
+	}
+}
+
+static void upng_scanlines_emit(upng_t* upng, upng_scanlines* rows, const unsigned char* row, const unsigned char* palette, unsigned long y)
+{
+	if (rows->levels) {
+		upng_scanlines_levels(upng, rows, row, palette, y);
+	} else {
+		upng_scanlines_native(upng, rows, row, palette, y);
+	}
+}
+
+/* composite a scanline of gray or color with alpha against the background, into a scanline of gray of the same depth;
+   fully transparent and fully opaque pixels take the background or their own gray as they are */
+static const unsigned char* upng_scanlines_composite(upng_t* upng, upng_scanlines* rows, const unsigned char* row)
+{
+	unsigned channels = upng_source_components(upng);
+	unsigned depth = upng->color_depth;
+	unsigned long max = (1ul << depth) - 1;
+	unsigned long background = ((unsigned long)upng->background * max + 127) / 255;
+	unsigned long x;
+
+	if (rows->gray == NULL) {
+		rows->gray = (unsigned char*)upng_calloc(upng, (upng->width * depth + 7) / 8, 1);
+		if (rows->gray == NULL) {
+			SET_ERROR(upng, UPNG_ENOMEM);
+			return NULL;
+		}
+	}
+
+	for (x = 0; x < rows->width; x++) {
+		unsigned long alpha = upng_sample_get(NULL, row, x * channels + channels - 1, depth);
+		unsigned long value = background;
+
+		if (alpha != 0) {
+			value = upng_sample_get(NULL, row, x * channels, depth);
+			if (channels == 4) {
+				unsigned long g = upng_sample_get(NULL, row, x * channels + 1, depth);
+				unsigned long b = upng_sample_get(NULL, row, x * channels + 2, depth);
+				value = (77 * value + 150 * g + 29 * b + 128) >> 8;
+			}
+			if (alpha != max) {
+				value = (value * alpha + background * (max - alpha) + max / 2) / max;
+			}
+		}
+
+		upng_sample_put(rows->gray, x, depth, (unsigned)value);
+	}
+
+	return rows->gray;
+}
+
+/* put the pixels of an unfiltered scanline of the current Adam7 pass where they belong in the image buffer. in preview
+   mode each pixel also fills the block of pixels that later passes will overwrite, so after every pass the image is
+   complete, just coarser: the first pass draws 8x8 blocks, the second halves their width and so on. gray levels
+   are dithered by position, as the pixels do not come in order. with auto levels the first pass, a reduced image of
+   the whole, is held back and counted in the histogram, then placed from lumas once the cut points are picked */
+static void upng_scanlines_place(upng_t* upng, upng_scanlines* rows, const unsigned char* row, const unsigned char* lumas)
+{
+	unsigned x0 = ADAM7_IX[rows->pass], y0 = ADAM7_IY[rows->pass];
+	unsigned dx = ADAM7_DX[rows->pass], dy = ADAM7_DY[rows->pass];
+	unsigned bw = 1, bh = 1;
+	unsigned bpp = upng_get_bpp(upng);
+	unsigned long bytes = bpp / 8;
+	int collect = rows->autolevels && rows->tone == NULL;
+	unsigned x, y;
+
+	if (collect && !upng_levels_alloc(upng, rows, (unsigned long)rows->width * rows->height)) {
+		return;
+	}
+
+	if (rows->preview) {
+		bw = dx - x0;
+		bh = dy - y0;
+	}
+
+	y0 += rows->y * dy;
+	if (bh > upng->height - y0) {
+		bh = upng->height - y0;
+	}
+
+	for (x = 0; x < rows->width; x++) {
+		unsigned long px = x0 + x * dx;
+		unsigned n = bw;
+		if (n > upng->width - px) {
+			n = upng->width - px;
+		}
+
+		if (rows->levels) {
+			unsigned luma = lumas != NULL ? lumas[x] : 0;
+			int level = lumas != NULL ? -1 : upng_pixel_level(upng, rows->palette, row, x, &luma);
+
+			if (collect) {
+				rows->delay[rows->y * rows->width + x] = (unsigned char)luma;
+				rows->histogram[luma >> 2]++;
+				continue;
+			}
+			if (level < 0 && rows->tone != NULL) {
+				luma = rows->tone[luma];
+			}
+			if (level < 0) {
+				level = (int)upng_level_ordered(rows, luma, px, y0);
+			}
+			upng_levels_put(rows, px, y0, n, bh, (unsigned)level);
+			continue;
+		}
+
+		for (y = 0; y < bh; y++) {
+			unsigned char* line = upng_image_row(rows, y0 + y, (unsigned long)upng->width * bytes);
+			unsigned i;
+
+			if (rows->palette != NULL && bytes != 0) {
+				memset(line + px, rows->palette[row[x]], n);
+			} else if (bytes != 0) {
+				for (i = 0; i < n; i++) {
+					memcpy(line + (px + i) * bytes, row + x * bytes, bytes);
+				}
+			} else {
+				/* 1, 2 and 4 bit pixels never straddle a byte */
+				unsigned value = upng_sample_get(rows->palette, row, x, bpp);
+
+				for (i = 0; i < n; i++) {
+					upng_image_put(rows, y0 + y, upng->width, px + i, bpp, value);
+				}
+			}
+		}
+	}
+
+	if (collect && rows->y + 1 == rows->height && upng_levels_pick(upng, rows)) {
+		unsigned held = rows->y;
+
+		for (rows->y = 0; rows->y < rows->height && upng->error == UPNG_EOK; rows->y++) {
+			upng_scanlines_place(upng, rows, NULL, rows->delay + rows->y * rows->width);
+		}
+		rows->y = held;
+		upng_dealloc(upng, rows->delay);
+		rows->delay = NULL;
+	}
+}
+
+/* add a scanline to the sums of the output scanline it falls in, and pass that on once its last source scanline is
+   in: every output pixel is the average of the box of source pixels it covers. only the one row of sums is kept */
+static void upng_scanlines_scale(upng_t* upng, upng_scanlines* rows, const unsigned char* row)
+{
+	unsigned channels = upng_get_components(upng);
+	unsigned depth = upng->color_depth;
+	unsigned long ow = rows->image_width, oh = rows->image_height;
+	unsigned long oy = (unsigned long)rows->y * oh / upng->height;
+	unsigned long x, c, boxh;
+	unsigned char* line;
+
+	if (rows->sums == NULL) {
+		rows->sums = (unsigned long*)upng_calloc(upng, ow * channels, sizeof(unsigned long));
+		if (rows->sums == NULL) {
+			SET_ERROR(upng, UPNG_ENOMEM);
+			return;
+		}
+	}
+
+	for (x = 0; x < upng->width; x++) {
+		unsigned long* sum = rows->sums + x * ow / upng->width * channels;
+		for (c = 0; c < channels; c++) {
+			sum[c] += upng_sample_get(rows->palette, row, x * channels + c, depth);
+		}
+	}
+
+	/* the source scanlines of output scanline oy are those from ceil(oy * h / oh) on, columns alike */
+	if (rows->y + 1 < upng->height && (rows->y + 1) * oh / upng->height == oy) {
+		return;
+	}
+	boxh = ((oy + 1) * upng->height + oh - 1) / oh - (oy * upng->height + oh - 1) / oh;
+
+	/* the averages go into the buffer the next scanline will use, which holds nothing that is still needed */
+	line = upng_scanlines_line(upng, rows, rows->y + 1);
+	if (line == NULL) {
+		return;
+	}
+
+	for (x = 0; x < ow; x++) {
+		unsigned long count = boxh * (((x + 1) * upng->width + ow - 1) / ow - (x * upng->width + ow - 1) / ow);
+
+		for (c = 0; c < channels; c++) {
+			unsigned long* sum = rows->sums + x * channels + c;
+			upng_sample_put(line + 1, x * channels + c, depth, (unsigned)((*sum + count / 2) / count));
+			*sum = 0;
+		}
+	}
+
+	upng_scanlines_emit(upng, rows, line + 1, NULL, oy);
+}
+
+/*append inflated data to the scanline being assembled; every completed scanline is unfiltered against the previous one and passed to the row callback,
+  or put into the image buffer. a scanline that comes in one piece is unfiltered straight from data, and with filter type None and stable data not even copied.
+  the pass callback is told whenever the last scanline of a pass is done*/
+static void upng_scanlines_feed(upng_t* upng, upng_scanlines* rows, const unsigned char* data, unsigned long length)
+{
+	while (length > 0) {
+		unsigned long n = rows->linebytes + 1 - rows->fill;
+		const unsigned char* scanline;	/* filter type byte followed by the filtered scanline */
+		const unsigned char* row;
+		const unsigned char* pixels;
+		unsigned char* line = NULL;
+		int direct;
+
+		/* error: more image data than the header says there are scanlines */
+		if (rows->pass >= rows->passes) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			return;
+		}
+
+		if (rows->fill == 0 && n <= length) {
+			scanline = data;
+		} else {
+			line = upng_scanlines_line(upng, rows, rows->y);
+			if (line == NULL) {
+				return;
+			}
+
+			if (n > length) {
+				n = length;
+			}
+
+			memcpy(line + rows->fill, data, n);
+			rows->fill += n;
+			if (rows->fill < rows->linebytes + 1) {
+				break;
+			}
+			scanline = line;
+		}
+		data += n;
+		length -= n;
+
+		/* scanlines that go into the image buffer unchanged are unfiltered right there */
+		direct = rows->image != NULL && rows->passes == 1 && !rows->levels && rows->palette == NULL && !rows->composite && rows->image_width == upng->width && rows->image_height == upng->height && rows->width * rows->bpp == rows->linebytes * 8;
+
+		if (direct) {
+			unfilter_scanline(upng, upng_image_row(rows, rows->y, rows->linebytes), scanline + 1, rows->previous, rows->bytewidth, scanline[0], rows->linebytes);
+			row = upng_image_row(rows, rows->y, rows->linebytes);
+		} else if (scanline[0] == 0 && (rows->stable || scanline == line)) {
+			row = scanline + 1;
+		} else {
+			line = upng_scanlines_line(upng, rows, rows->y);
+			if (line == NULL) {
+				return;
+			}
+
+			unfilter_scanline(upng, line + 1, scanline + 1, rows->previous, rows->bytewidth, scanline[0], rows->linebytes);
+			row = line + 1;
+		}
+		if (upng->error != UPNG_EOK) {
+			return;
+		}
+
+		/* the unfiltered scanline itself stays as it is for unfiltering the next one */
+		pixels = rows->composite ? upng_scanlines_composite(upng, rows, row) : row;
+		if (pixels == NULL) {
+			return;
+		}
+
+		if (rows->passes > 1) {
+			upng_scanlines_place(upng, rows, pixels, NULL);
+		} else if (rows->image_width != upng->width || rows->image_height != upng->height) {
+			upng_scanlines_scale(upng, rows, pixels);
+		} else if (!direct) {
+			upng_scanlines_emit(upng, rows, pixels, rows->palette, rows->y);
+		}
+		if (upng->error != UPNG_EOK) {
+			return;
+		}
+
+		rows->previous = row;
+		rows->fill = 0;
+		rows->y++;
+
+		if (rows->y == rows->height) {
+			unsigned pass = rows->pass++;
+
+			upng_scanlines_pass(upng, rows);
+			if (rows->pass_callback != NULL) {
+				rows->pass_callback(rows->user, pass, rows->pass == rows->passes);
+			}
+		}
+	}
+}
+
+/*out must be buffer big enough to contain full image, and in must contain the full decompressed data from the IDAT chunks*/
+static void post_process_scanlines(upng_t* upng, unsigned char *out, unsigned char *in, const upng_t* info_png)
+{
+	unsigned bpp = upng_source_bpp(info_png);
+	unsigned w = info_png->width;
+	unsigned h = info_png->height;
+
+	if (bpp == 0) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return;
+	}
+
+	/* Adam7: every pass is a reduced image of its own, whose pixels are spread out over the image. gray levels,
+	   indexed images, scaled images and composited ones are written pixel by pixel too */
+	if (info_png->interlace || info_png->output != UPNG_OUTPUT_NATIVE || info_png->color_type == UPNG_PLT || info_png->scale_width != 0 || upng_composited(info_png)) {
+		upng_scanlines rows;
+
+		upng_scanlines_init(upng, &rows);
+		rows.image = out;
+		/* unfiltered scanlines can be left in the inflated data only while the image does not overwrite it */
+		rows.stable = out != in;
+		upng_scanlines_feed(upng, &rows, in, upng_inflated_size(upng));
+		upng_scanlines_free(upng, &rows);
+		return;
+	}
+
+	if (bpp < 8 && w * bpp != ((w * bpp + 7) / 8) * 8) {
 		unfilter(upng, in, in, w, h, bpp);
 		if (upng->error != UPNG_EOK) {
 			return;
 		}
-		remove_padding_bits(out, in, w * bpp, ((w * bpp + 7) / 8) * 8, h);
-	} else {
-		unfilter(upng, out, in, w, h, bpp);	/*we can immediatly filter into the out buffer, no other steps needed */
+		remove_padding_bits(out, in, w * bpp, ((w * bpp + 7) / 8) * 8, h);
+	} else {
+		unfilter(upng, out, in, w, h, bpp);	/*we can immediatly filter into the out buffer, no other steps needed */
+	}
+}
+
+static upng_format luminance_format(unsigned depth) {
+	switch (depth) {
+	case 1:
+		return UPNG_LUMINANCE1;
+	case 2:
+		return UPNG_LUMINANCE2;
+	case 4:
+		return UPNG_LUMINANCE4;
+	case 8:
+		return UPNG_LUMINANCE8;
+	case 16:
+		return UPNG_LUMINANCE16;
+	default:
+		return UPNG_BADFORMAT;
+	}
+}
+
+static upng_format determine_format(upng_t* upng) {
+	switch (upng->color_type) {
+	case UPNG_LUM:
+		return luminance_format(upng->color_depth);
+	case UPNG_PLT:
+		/* indexed images are decoded to gray levels of the same bit depth */
+		switch (upng->color_depth) {
+		case 1:
+			return UPNG_LUMINANCE1;
+		case 2:
+			return UPNG_LUMINANCE2;
+		case 4:
+			return UPNG_LUMINANCE4;
+		case 8:
+			return UPNG_LUMINANCE8;
+		default:
+			return UPNG_BADFORMAT;
+		}
+	case UPNG_RGB:
+		switch (upng->color_depth) {
+		case 8:
+			return UPNG_RGB8;
+		case 16:
+			return UPNG_RGB16;
+		default:
+			return UPNG_BADFORMAT;
+		}
+	case UPNG_LUMA:
+		switch (upng->color_depth) {
+		case 1:
+			return UPNG_LUMINANCE_ALPHA1;
+		case 2:
+			return UPNG_LUMINANCE_ALPHA2;
+		case 4:
+			return UPNG_LUMINANCE_ALPHA4;
+		case 8:
+			return UPNG_LUMINANCE_ALPHA8;
+		case 16:
+			return UPNG_LUMINANCE_ALPHA16;
+		default:
+			return UPNG_BADFORMAT;
+		}
+	case UPNG_RGBA:
+		switch (upng->color_depth) {
+		case 8:
+			return UPNG_RGBA8;
+		case 16:
+			return UPNG_RGBA16;
+		default:
+			return UPNG_BADFORMAT;
+		}
+	default:
+		return UPNG_BADFORMAT;
+	}
+}
+
+static void upng_free_source(upng_t* upng)
+{
+	if (upng->source.owning != 0) {
+		free((void*)upng->source.buffer);
+	}
+
+	/* the CRC table is only needed for reading it */
+	upng_dealloc(upng, upng->crc_table);
+	upng->crc_table = NULL;
+
+	upng->source.buffer = NULL;
+	upng->source.size = 0;
+	upng->source.owning = 0;
+
+	/* the window stays for the next PNG read through one */
+	upng->source.read = NULL;
+	upng->source.user = NULL;
+	upng->source.window_offset = upng->source.window_fill = 0;
+}
+
+/*read the information from the header and store it in the upng_Info. return value is error*/
+upng_error upng_header(upng_t* upng)
+{
+	const unsigned char* header;
+
+	/* if we have an error state, bail now */
+	if (upng->error != UPNG_EOK) {
+		return upng->error;
+	}
+
+	/* if the state is not NEW (meaning we are ready to parse the header), stop now */
+	if (upng->state != UPNG_NEW) {
+		return upng->error;
+	}
+
+	/* minimum length of a valid PNG file is 29 bytes
+	 * FIXME: verify this against the specification, or
+	 * better against the actual code below */
+	header = upng_source_at(&upng->source, 0, 29);
+	if (header == NULL) {
+		SET_ERROR(upng, UPNG_ENOTPNG);
+		return upng->error;
+	}
+
+	/* check that PNG header matches expected value */
+	if (header[0] != 137 || header[1] != 80 || header[2] != 78 || header[3] != 71 || header[4] != 13 || header[5] != 10 || header[6] != 26 || header[7] != 10) {
+		SET_ERROR(upng, UPNG_ENOTPNG);
+		return upng->error;
+	}
+
+	/* check that the first chunk is the IHDR chunk */
+	if (MAKE_DWORD_PTR(header + 12) != CHUNK_IHDR) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return upng->error;
+	}
+
+	/* read the values given in the header */
+	upng->width = MAKE_DWORD_PTR(header + 16);
+	upng->height = MAKE_DWORD_PTR(header + 20);
+	upng->color_depth = header[24];
+	upng->color_type = (upng_color)header[25];
+
+	/* determine our color format */
+	upng->format = determine_format(upng);
+	if (upng->format == UPNG_BADFORMAT) {
+		SET_ERROR(upng, UPNG_EUNFORMAT);
+		return upng->error;
+	}
+
+	/* check that the compression method (byte 27) is 0 (only allowed value in spec) */
+	if (header[26] != 0) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return upng->error;
+	}
+
+	/* check that the compression method (byte 27) is 0 (only allowed value in spec) */
+	if (header[27] != 0) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return upng->error;
+	}
+
+	/* check that the interlace method (byte 28) is 0 (none) or 1 (Adam7) */
+	if (header[28] > 1) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return upng->error;
+	}
+	upng->interlace = header[28];
+
+	upng->state = UPNG_HEADER;
+	return upng->error;
+}
+
+/*collapse the palette into a table that maps each byte of packed indices to the same byte of gray levels, at the
+  bit depth of the image, so scanlines can be converted a byte at a time. the gray level is the luma of the color,
+  and indices past the end of the palette are black*/
+static void upng_palette_create(upng_t* upng, unsigned long plte, unsigned long length)
+{
+	unsigned depth = upng->color_depth;
+	unsigned max = (1u << depth) - 1;
+	unsigned char gray[256];
+	unsigned i, k;
+
+	if (length == 0 || length % 3 != 0 || length / 3 > 256) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return;
+	}
+
+	if (upng->palette == NULL) {
+		upng->palette = (unsigned char*)upng_alloc(upng, 256);
+		if (upng->palette == NULL) {
+			SET_ERROR(upng, UPNG_ENOMEM);
+			return;
+		}
+	}
+
+	for (i = 0; i <= max; i++) {
+		unsigned luma = 0;
+		if (i < length / 3) {
+			/* the palette may be larger than the window a PNG is read through, so it is read a color at a time */
+			const unsigned char* rgb = upng_source_at(&upng->source, plte + i * 3, 3);
+			if (rgb == NULL) {
+				SET_ERROR(upng, UPNG_EMALFORMED);
+				return;
+			}
+			luma = (77 * rgb[0] + 150 * rgb[1] + 29 * rgb[2] + 128) >> 8;
+		}
+		gray[i] = (unsigned char)((luma * max + 127) / 255);
+	}
+
+	for (i = 0; i < 256; i++) {
+		unsigned value = 0;
+		for (k = 0; k < 8; k += depth) {
+			value |= (unsigned)gray[(i >> k) & max] << k;
+		}
+		upng->palette[i] = (unsigned char)value;
+	}
+}
+
+/*check the chunks following the header for well-formed-ness and index the IDAT chunks, all in one pass over the chunk
+  list; return value is nonzero if there is image data to decode*/
+static int upng_index_chunks(upng_t* upng)
+{
+	const unsigned char* header;
+	unsigned long chunk;
+	int palette = 0;
+
+	upng->idat_count = 0;
+
+	/* with UPNG_VERIFY_FULL every chunk has its CRC checked: the header here, the others as they are walked
+	   below, except for the IDAT chunks after the first, which are checked as the image data streams into them */
+	if (upng->verify == UPNG_VERIFY_FULL && upng->crc_table == NULL) {
+		upng->crc_table = upng_crc_table_create(upng);
+		if (upng->crc_table == NULL) {
+			SET_ERROR(upng, UPNG_ENOMEM);
+			return 0;
+		}
+	}
+	if (upng->crc_table != NULL && upng->source.size >= 33 && !upng_chunk_crc_ok(&upng->source, upng->crc_table, 8)) {
+		SET_ERROR(upng, UPNG_ECHECKSUM);
+		return 0;
+	}
+
+	/* first byte of the first chunk after the header */
+	chunk = 33;
+
+	/* scan through the chunks, finding the first IDAT chunk, and also
+	 * verify general well-formed-ness */
+	while (chunk < upng->source.size) {
+		unsigned long length, type;
+		int critical;
+
+		/* make sure chunk header is not larger than the total compressed */
+		header = upng_source_at(&upng->source, chunk, 8);
+		if (chunk + 12 > upng->source.size || header == NULL) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			return 0;
+		}
+
+		/* get length; sanity check it */
+		length = upng_chunk_length(header);
+		if (length > INT_MAX) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			return 0;
+		}
+
+		/* reading the rest of the chunk may move the window the header is in */
+		type = upng_chunk_type(header);
+		critical = upng_chunk_critical(header);
+
+		/* make sure chunk header+paylaod is not larger than the total compressed */
+		if (chunk + length + 12 > upng->source.size) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			return 0;
+		}
+
+		if (upng->crc_table != NULL && (type != CHUNK_IDAT || upng->idat_count == 0) && !upng_chunk_crc_ok(&upng->source, upng->crc_table, chunk)) {
+			SET_ERROR(upng, UPNG_ECHECKSUM);
+			return 0;
+		}
+
+		/* parse chunks */
+		if (type == CHUNK_IDAT) {
+			if (upng->idat_count < UPNG_IDAT_INDEX) {
+				upng->idat[upng->idat_count].offset = chunk;
+				upng->idat[upng->idat_count].length = length;
+			}
+			upng->idat_count++;
+		} else if (type == CHUNK_IEND) {
+			break;
+		} else if (type == CHUNK_PLTE) {
+			/* only indexed images need the palette, it is a mere suggestion for truecolor ones */
+			if (upng->color_type == UPNG_PLT) {
+				upng_palette_create(upng, chunk + 8, length);
+				if (upng->error != UPNG_EOK) {
+					return 0;
+				}
+				palette = 1;
+			}
+		} else if (critical) {
+			SET_ERROR(upng, UPNG_EUNSUPPORTED);
+			return 0;
+		}
+
+		chunk += length + 12;
+	}
+
+	/* an image without any IDAT chunk has no image data, and an indexed one needs a palette before it (one kept from
+	   an earlier image does not count) */
+	if (upng->idat_count == 0 || (upng->color_type == UPNG_PLT && !palette)) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*give back the image buffer*/
+static void upng_release_image(upng_t* upng)
+{
+	upng_dealloc(upng, upng->buffer);
+	upng->buffer = NULL;
+	upng->size = 0;
+	upng->capacity = 0;
+}
+
+/*allocate the image buffer for the output format, or reuse the one of an earlier image if it is large enough; bit
+  planes start out black, as their padding bits must stay*/
+static int upng_alloc_image(upng_t* upng)
+{
+	unsigned long size = upng_image_size(upng);
+
+	if (upng->buffer == NULL || upng->capacity < size) {
+		upng_release_image(upng);
+		upng->buffer = (unsigned char*)upng_alloc(upng, size);
+		if (upng->buffer == NULL) {
+			SET_ERROR(upng, UPNG_ENOMEM);
+			return 0;
+		}
+		upng->capacity = size;
+	}
+	upng->size = size;
+
+	if (upng->output == UPNG_OUTPUT_PLANES) {
+		memset(upng->buffer, 0, upng->size);
+	}
+
+	return 1;
+}
+
+/*check that the image can be decoded into the output format: bit planes in the image buffer are as wide as the
+  framebuffer, with a stride the caller has made room for them. scaling needs the scanlines in order*/
+static void upng_check_output(upng_t* upng, unsigned long stride)
+{
+	if (upng->output == UPNG_OUTPUT_PLANES && stride == 0 && upng_get_width(upng) > UPNG_PLANE_STRIDE * 8) {
+		SET_ERROR(upng, UPNG_EUNFORMAT);
+	} else if (upng->interlace && upng->scale_width != 0 && (upng_get_width(upng) != upng->width || upng_get_height(upng) != upng->height)) {
+		SET_ERROR(upng, UPNG_EUNINTERLACED);
+	}
+}
+
+/*with upng_set_in_place, check that the image can be written over the inflated data as it is unfiltered: each output
+  scanline has to end where the filtered one it comes from does, or before. bit planes and Adam7 passes are spread over
+  the whole image, so they never can*/
+static int upng_in_place_fits(const upng_t* upng)
+{
+	unsigned width, height;
+	unsigned long obits;
+
+	if (!upng->in_place || upng->interlace || upng->output == UPNG_OUTPUT_PLANES) {
+		return 0;
+	}
+
+	upng_scaled_size(upng, &width, &height);
+	obits = (unsigned long)width * (upng->output == UPNG_OUTPUT_LEVELS ? 2 : upng_get_bpp(upng));
+	return obits <= 8 * ((upng->width * upng_source_bpp(upng) + 7) / 8 + 1);
+}
+
+/*inflate the image data into a temporary buffer, then unfilter it into the image buffer*/
+static void upng_decode_inflate(upng_t* upng, uz_stream* stream)
+{
+	unsigned char* inflated;
+	unsigned long inflated_size;
+	upng_error error;
+
+	/* allocate space to store inflated (but still filtered) data */
+	inflated_size = upng_inflated_size(upng);
+	inflated = (unsigned char*)upng_alloc(upng, inflated_size);
+	if (inflated == NULL) {
+		SET_ERROR(upng, UPNG_ENOMEM);
+		return;
+	}
+
+	error = uz_inflate(upng, inflated, inflated_size, stream);
+
+	if (error != UPNG_EOK) {
+		upng_dealloc(upng, inflated);
+		return;
+	}
+
+	/* the image replaces the inflated data, which then only keeps its size */
+	if (upng_in_place_fits(upng)) {
+		post_process_scanlines(upng, inflated, inflated, upng);
+		if (upng->error != UPNG_EOK) {
+			upng_dealloc(upng, inflated);
+			return;
+		}
+
+		upng_release_image(upng);
+		upng->size = upng->capacity = upng_image_size(upng);
+		upng->buffer = (unsigned char*)upng_shrink(upng, inflated, upng->size);
+		return;
 	}
-}
 
-static upng_format determine_format(upng_t* upng) {
-	switch (upng->color_type) {
-	case UPNG_LUM:
-		switch (upng->color_depth) {
-		case 1:
-			return UPNG_LUMINANCE1;
-		case 2:
-			return UPNG_LUMINANCE2;
-		case 4:
-			return UPNG_LUMINANCE4;
-		case 8:
-			return UPNG_LUMINANCE8;
-		default:
-			return UPNG_BADFORMAT;
-		}
-	case UPNG_RGB:
-		switch (upng->color_depth) {
-		case 8:
-			return UPNG_RGB8;
-		case 16:
-			return UPNG_RGB16;
-		default:
-			return UPNG_BADFORMAT;
-		}
-	case UPNG_LUMA:
-		switch (upng->color_depth) {
-		case 1:
-			return UPNG_LUMINANCE_ALPHA1;
-		case 2:
-			return UPNG_LUMINANCE_ALPHA2;
-		case 4:
-			return UPNG_LUMINANCE_ALPHA4;
-		case 8:
-			return UPNG_LUMINANCE_ALPHA8;
-		default:
-			return UPNG_BADFORMAT;
-		}
-	case UPNG_RGBA:
-		switch (upng->color_depth) {
-		case 8:
-			return UPNG_RGBA8;
-		case 16:
-			return UPNG_RGBA16;
-		default:
-			return UPNG_BADFORMAT;
-		}
-	default:
-		return UPNG_BADFORMAT;
+	/* allocate final image buffer */
+	if (!upng_alloc_image(upng)) {
+		upng_dealloc(upng, inflated);
+		return;
 	}
+
+	/* unfilter scanlines */
+	post_process_scanlines(upng, upng->buffer, inflated, upng);
+	upng_dealloc(upng, inflated);
 }
 
-static void upng_free_source(upng_t* upng)
+/*the image data is in stored blocks only: unfilter it straight out of the IDAT chunks into the image buffer,
+  saving the inflated buffer and the copy into it*/
+static void upng_decode_stored(upng_t* upng, uz_stream* stream)
 {
-	if (upng->source.owning != 0) {
-		free((void*)upng->source.buffer);
+	upng_scanlines rows;
+	uz_inflate_state state;
+
+	upng_scanlines_init(upng, &rows);
+	rows.stable = upng->source.read == NULL;
+
+	if (!upng_alloc_image(upng)) {
+		return;
 	}
+	rows.image = upng->buffer;
 
-	upng->source.buffer = NULL;
-	upng->source.size = 0;
-	upng->source.owning = 0;
+	uz_inflate_init(&state);
+	uz_stream_stored(upng, stream, upng_inflated_size(upng), &rows, &state, ULONG_MAX);
+	upng_scanlines_free(upng, &rows);
 }
 
-/*read the information from the header and store it in the upng_Info. return value is error*/
-upng_error upng_header(upng_t* upng)
+/*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
+upng_error upng_decode(upng_t* upng)
 {
+	uz_stream stream;
+
 	/* if we have an error state, bail now */
 	if (upng->error != UPNG_EOK) {
 		return upng->error;
 	}
 
-	/* if the state is not NEW (meaning we are ready to parse the header), stop now */
-	if (upng->state != UPNG_NEW) {
+	/* parse the main header, if necessary */
+	upng_header(upng);
+	if (upng->error != UPNG_EOK) {
 		return upng->error;
 	}
 
-	/* minimum length of a valid PNG file is 29 bytes
-	 * FIXME: verify this against the specification, or
-	 * better against the actual code below */
-	if (upng->source.size < 29) {
-		SET_ERROR(upng, UPNG_ENOTPNG);
+	/* if the state is not HEADER (meaning we are ready to decode the image), stop now */
+	if (upng->state != UPNG_HEADER) {
 		return upng->error;
 	}
 
-	/* check that PNG header matches expected value */
-	if (upng->source.buffer[0] != 137 || upng->source.buffer[1] != 80 || upng->source.buffer[2] != 78 || upng->source.buffer[3] != 71 || upng->source.buffer[4] != 13 || upng->source.buffer[5] != 10 || upng->source.buffer[6] != 26 || upng->source.buffer[7] != 10) {
-		SET_ERROR(upng, UPNG_ENOTPNG);
+	upng_check_output(upng, 0);
+	if (upng->error != UPNG_EOK) {
 		return upng->error;
 	}
 
-	/* check that the first chunk is the IHDR chunk */
-	if (MAKE_DWORD_PTR(upng->source.buffer + 12) != CHUNK_IHDR) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
+	if (!upng_index_chunks(upng)) {
+		upng_dealloc(upng, upng->crc_table);
+		upng->crc_table = NULL;
 		return upng->error;
 	}
 
-	/* read the values given in the header */
-	upng->width = MAKE_DWORD_PTR(upng->source.buffer + 16);
-	upng->height = MAKE_DWORD_PTR(upng->source.buffer + 20);
-	upng->color_depth = upng->source.buffer[24];
-	upng->color_type = (upng_color)upng->source.buffer[25];
+	/* decompress image data, reading it straight out of the IDAT chunks */
+	uz_stream_init(&stream, upng);
+	uz_inflate_header(upng, &stream);
+	if (upng->error == UPNG_EOK) {
+		uz_stream probe = stream;
+		uz_inflate_state walk;
+		int stored;
+
+		/* the probe leaves the CRCs to the pass that uses the data */
+		probe.crc_table = NULL;
+		uz_inflate_init(&walk);
+		stored = uz_stream_stored(upng, &probe, upng_inflated_size(upng), NULL, &walk, ULONG_MAX) == 1;
+
+		/* a PNG read through the window has it where the probe stopped */
+		uz_stream_reload(&stream);
+		if (stored) {
+			upng_decode_stored(upng, &stream);
+		} else {
+			upng_decode_inflate(upng, &stream);
+		}
+	}
 
-	/* determine our color format */
-	upng->format = determine_format(upng);
-	if (upng->format == UPNG_BADFORMAT) {
-		SET_ERROR(upng, UPNG_EUNFORMAT);
-		return upng->error;
+	/* the image data ran out at an IDAT chunk that failed its CRC */
+	if (stream.corrupt) {
+		SET_ERROR(upng, UPNG_ECHECKSUM);
 	}
 
-	/* check that the compression method (byte 27) is 0 (only allowed value in spec) */
-	if (upng->source.buffer[26] != 0) {
+	if (upng->error != UPNG_EOK) {
+		upng_release_image(upng);
+	} else {
+		upng->state = UPNG_DECODED;
+	}
+
+	/* we are done with our input buffer; free it if we own it */
+	upng_free_source(upng);
+
+	return upng->error;
+}
+
+/* a decode through the scanline decoder, from the zlib header to the last scanline; it can stop and go on */
+typedef struct upng_decoding {
+	upng_scanlines*		rows;
+	uz_stream			stream;
+	uz_output			output;		/* the buffer is the window, NULL for stored blocks only */
+	uz_inflate_state	inflate;
+	int					stored;		/* the image data is in stored blocks only, rows get it straight out of the IDAT chunks */
+} upng_decoding;
+
+/*get a decode going that inflates the image data with a sliding window, or walks its stored blocks, feeding it to
+  rows as it comes. return value is 0 on error; upng_decoding_end has to be called either way*/
+static int upng_decoding_begin(upng_t* upng, upng_decoding* d, upng_scanlines* rows)
+{
+	unsigned long window_size;
+	uz_stream probe;
+	uz_inflate_state walk;
+
+	memset(d, 0, sizeof(*d));
+	d->rows = rows;
+	uz_inflate_init(&d->inflate);
+
+	if (!upng_index_chunks(upng)) {
+		return 0;
+	}
+
+	/* the palette is only known once the chunks before the image data are read */
+	rows->palette = upng->color_type == UPNG_PLT ? upng->palette : NULL;
+
+	/* the window only needs to cover the distances the stream was compressed with, and never more than the whole stream */
+	uz_stream_init(&d->stream, upng);
+	window_size = uz_inflate_header(upng, &d->stream);
+	if (upng->error != UPNG_EOK) {
+		return 0;
+	}
+
+	d->output.limit = upng_inflated_size(upng);
+	if (window_size > d->output.limit) {
+		window_size = d->output.limit;
+	}
+
+	/* stored blocks only: the scanlines come straight out of the IDAT chunks, there is no window to fill */
+	probe = d->stream;
+	probe.crc_table = NULL;
+	uz_inflate_init(&walk);
+	d->stored = uz_stream_stored(upng, &probe, d->output.limit, NULL, &walk, ULONG_MAX) == 1;
+	uz_stream_reload(&d->stream);
+	if (d->stored) {
+		/* rows can keep pointers into a PNG in memory, not into the window it is read through */
+		rows->stable = upng->source.read == NULL;
+		return 1;
+	}
+
+	d->output.buffer = (unsigned char*)upng_alloc(upng, window_size);
+	if (d->output.buffer == NULL) {
+		SET_ERROR(upng, UPNG_ENOMEM);
+		return 0;
+	}
+
+	d->output.size = window_size;
+	d->output.flush_at = (upng->width * rows->bpp + 7) / 8 + 1;
+	d->output.adler = 1;
+	d->output.scanlines = rows;
+
+	/* the window is reused as it fills, so scanlines have to be copied out of it */
+	rows->stable = 0;
+	return 1;
+}
+
+/*go on with a decode until about budget more bytes of image data went through; return value is 1 once it is done
+  or an error occured, 0 if there is more to do*/
+static int upng_decoding_run(upng_t* upng, upng_decoding* d, unsigned long budget)
+{
+	if (d->stored) {
+		return uz_stream_stored(upng, &d->stream, d->output.limit, d->rows, &d->inflate, uz_inflate_stop(d->inflate.total, budget)) >= 0;
+	}
+
+	d->output.stop = uz_inflate_stop(d->output.base + d->output.pos, budget);
+	return uz_inflate_run(upng, &d->output, &d->stream, &d->inflate);
+}
+
+/*finish a decode, done or not: give back its memory, and check it got to the last scanline*/
+static void upng_decoding_end(upng_t* upng, upng_decoding* d)
+{
+	uz_inflate_release(upng, &d->inflate);
+	upng_dealloc(upng, d->output.buffer);
+	d->output.buffer = NULL;
+
+	/* error: the image data ended before the last scanline */
+	if (upng->error == UPNG_EOK && d->rows->pass != d->rows->passes) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
+	}
+
+	/* the image data ran out at an IDAT chunk that failed its CRC */
+	if (d->stream.corrupt) {
+		SET_ERROR(upng, UPNG_ECHECKSUM);
+	}
+}
+
+/* what upng_decode_step carries from one call to the next */
+typedef struct upng_step {
+	upng_scanlines	rows;
+	upng_decoding	decoding;
+} upng_step;
+
+/*inflate the image data with a sliding window, or walk its stored blocks, feeding it to rows as it comes*/
+static void upng_decode_scanlines(upng_t* upng, upng_scanlines* rows)
+{
+	upng_decoding decoding;
+
+	if (upng_decoding_begin(upng, &decoding, rows)) {
+		upng_decoding_run(upng, &decoding, ULONG_MAX);
+	}
+	upng_decoding_end(upng, &decoding);
+}
+
+/*read a PNG scanline by scanline, handing each unfiltered scanline to callback as soon as it is complete.
+  only a sliding window of the inflated data and two scanlines are kept in memory, no image buffer is allocated.
+  image data in stored blocks needs no window, and scanlines with filter type None are passed on right out of the PNG data.
+  interlaced images cannot be decoded this way, their rows only come together in the last pass*/
+upng_error upng_decode_rows(upng_t* upng, upng_row_callback callback, void* user)
+{
+	upng_scanlines rows;
+
+	/* if we have an error state, bail now */
+	if (upng->error != UPNG_EOK) {
 		return upng->error;
 	}
 
-	/* check that the compression method (byte 27) is 0 (only allowed value in spec) */
-	if (upng->source.buffer[27] != 0) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
+	if (callback == NULL) {
+		SET_ERROR(upng, UPNG_EPARAM);
+		return upng->error;
+	}
+
+	/* parse the main header, if necessary */
+	upng_header(upng);
+	if (upng->error != UPNG_EOK) {
+		return upng->error;
+	}
+
+	/* if the state is not HEADER (meaning we are ready to decode the image), stop now */
+	if (upng->state != UPNG_HEADER) {
 		return upng->error;
 	}
 
-	/* check that the compression method (byte 27) is 0 (spec allows 1, but uPNG does not support it) */
-	if (upng->source.buffer[28] != 0) {
+	if (upng->interlace) {
 		SET_ERROR(upng, UPNG_EUNINTERLACED);
 		return upng->error;
 	}
 
-	upng->state = UPNG_HEADER;
+	/* the rows are the only result, an image buffer kept by upng_reset is not needed */
+	upng_release_image(upng);
+
+	/* bit planes need the image buffer, the rows get gray levels as with UPNG_OUTPUT_LEVELS */
+	upng_scanlines_init(upng, &rows);
+	rows.planes = 0;
+	rows.callback = callback;
+	rows.user = user;
+
+	upng_decode_scanlines(upng, &rows);
+	upng_scanlines_free(upng, &rows);
+
+	if (upng->error == UPNG_EOK) {
+		upng->state = UPNG_DECODED;
+	}
+
+	/* we are done with our input buffer; free it if we own it */
+	upng_free_source(upng);
+
 	return upng->error;
 }
 
-/*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
-upng_error upng_decode(upng_t* upng)
+/*read a PNG into the image buffer like upng_decode, calling callback each time an Adam7 pass is done. the buffer then
+  holds the whole image at the resolution of the passes so far, every pixel standing in for those still to come, so it
+  can be shown right away. images that are not interlaced have a single pass. the image data is inflated through a
+  sliding window, which needs less memory than upng_decode*/
+upng_error upng_decode_progressive(upng_t* upng, upng_pass_callback callback, void* user)
 {
-	const unsigned char *chunk;
-	unsigned char* compressed;
-	unsigned char* inflated;
-	unsigned long compressed_size = 0, compressed_index = 0;
-	unsigned long inflated_size;
-	upng_error error;
+	upng_scanlines rows;
+
+	/* if we have an error state, bail now */
+	if (upng->error != UPNG_EOK) {
+		return upng->error;
+	}
+
+	if (callback == NULL) {
+		SET_ERROR(upng, UPNG_EPARAM);
+		return upng->error;
+	}
+
+	/* parse the main header, if necessary */
+	upng_header(upng);
+	if (upng->error != UPNG_EOK) {
+		return upng->error;
+	}
+
+	/* if the state is not HEADER (meaning we are ready to decode the image), stop now */
+	if (upng->state != UPNG_HEADER) {
+		return upng->error;
+	}
+
+	upng_check_output(upng, 0);
+	if (upng->error != UPNG_EOK) {
+		return upng->error;
+	}
+
+	upng_scanlines_init(upng, &rows);
+	rows.preview = 1;
+	rows.pass_callback = callback;
+	rows.user = user;
+
+	if (!upng_alloc_image(upng)) {
+		return upng->error;
+	}
+	rows.image = upng->buffer;
+
+	upng_decode_scanlines(upng, &rows);
+	upng_scanlines_free(upng, &rows);
+
+	if (upng->error != UPNG_EOK) {
+		upng_release_image(upng);
+	} else {
+		upng->state = UPNG_DECODED;
+	}
+
+	/* we are done with our input buffer; free it if we own it */
+	upng_free_source(upng);
+
+	return upng->error;
+}
+
+/*read a PNG in output format straight into dst instead of the image buffer, each row starting stride bytes after the
+  one before; bit planes are two, one after the other, of height rows each. the image data is inflated through a
+  sliding window, as with upng_decode_rows*/
+upng_error upng_decode_into(upng_t* upng, unsigned char* dst, unsigned long stride, upng_output output)
+{
+	upng_scanlines rows;
+	unsigned long bits;
 
 	/* if we have an error state, bail now */
 	if (upng->error != UPNG_EOK) {
 		return upng->error;
 	}
 
+	if (dst == NULL || upng_set_output(upng, output) != UPNG_EOK) {
+		SET_ERROR(upng, UPNG_EPARAM);
+		return upng->error;
+	}
+
 	/* parse the main header, if necessary */
 	upng_header(upng);
 	if (upng->error != UPNG_EOK) {
@@ -1025,135 +3859,124 @@ upng_error upng_decode(upng_t* upng)
 		return upng->error;
 	}
 
-	/* release old result, if any */
-	if (upng->buffer != 0) {
-		free(upng->buffer);
-		upng->buffer = 0;
-		upng->size = 0;
+	/* a row of the output format has to fit in the stride */
+	bits = upng_get_width(upng);
+	if (output == UPNG_OUTPUT_LEVELS) {
+		bits *= 2;
+	} else if (output == UPNG_OUTPUT_NATIVE) {
+		bits *= upng_get_bpp(upng);
+	}
+	if (stride < (bits + 7) / 8) {
+		SET_ERROR(upng, UPNG_EPARAM);
+		return upng->error;
 	}
 
-	/* first byte of the first chunk after the header */
-	chunk = upng->source.buffer + 33;
-
-	/* scan through the chunks, finding the size of all IDAT chunks, and also
-	 * verify general well-formed-ness */
-	while (chunk < upng->source.buffer + upng->source.size) {
-		unsigned long length;
-		const unsigned char *data;	/*the data in the chunk */
+	upng_check_output(upng, stride);
+	if (upng->error != UPNG_EOK) {
+		return upng->error;
+	}
 
-		/* make sure chunk header is not larger than the total compressed */
-		if ((unsigned long)(chunk - upng->source.buffer + 12) > upng->source.size) {
-			SET_ERROR(upng, UPNG_EMALFORMED);
-			return upng->error;
-		}
+	/* the image goes to dst, an image buffer kept by upng_reset is not needed */
+	upng_release_image(upng);
 
-		/* get length; sanity check it */
-		length = upng_chunk_length(chunk);
-		if (length > INT_MAX) {
-			SET_ERROR(upng, UPNG_EMALFORMED);
-			return upng->error;
-		}
+	upng_scanlines_init(upng, &rows);
+	rows.image = dst;
+	rows.stride = stride;
 
-		/* make sure chunk header+paylaod is not larger than the total compressed */
-		if ((unsigned long)(chunk - upng->source.buffer + length + 12) > upng->source.size) {
-			SET_ERROR(upng, UPNG_EMALFORMED);
-			return upng->error;
-		}
+	/* bit planes start out black, as their padding bits must stay */
+	if (rows.planes) {
+		unsigned long y;
 
-		/* get pointer to payload */
-		data = chunk + 8;
-		/* parse chunks */
-		if (upng_chunk_type(chunk) == CHUNK_IDAT) {
-			compressed_size += length;
-		} else if (upng_chunk_type(chunk) == CHUNK_IEND) {
-			break;
-		} else if (upng_chunk_critical(chunk)) {
-			SET_ERROR(upng, UPNG_EUNSUPPORTED);
-			return upng->error;
+		for (y = 0; y < 2 * (unsigned long)upng_get_height(upng); y++) {
+			memset(dst + y * stride, 0, (bits + 7) / 8);
 		}
-
-		chunk += upng_chunk_length(chunk) + 12;
 	}
 
-	/* allocate enough space for the (compressed and filtered) image data */
-  APP_LOG(APP_LOG_LEVEL_DEBUG, "compressed_size:%d", compressed_size);
-	compressed = (unsigned char*)malloc(compressed_size);
-	if (compressed == NULL) {
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "FAILED: malloc compressed_size:%d", compressed_size);
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "FAILED: malloc ptr:%p", compressed);
-		SET_ERROR(upng, UPNG_ENOMEM);
-		return upng->error;
+	upng_decode_scanlines(upng, &rows);
+	upng_scanlines_free(upng, &rows);
+
+	if (upng->error == UPNG_EOK) {
+		upng->state = UPNG_DECODED;
 	}
 
-	/* scan through the chunks again, this time copying the values into
-	 * our compressed buffer.  there's no reason to validate anything a second time. */
-	chunk = upng->source.buffer + 33;
-	while (chunk < upng->source.buffer + upng->source.size) {
-		unsigned long length;
-		const unsigned char *data;	/*the data in the chunk */
+	/* we are done with our input buffer; free it if we own it */
+	upng_free_source(upng);
 
-		length = upng_chunk_length(chunk);
-		data = chunk + 8;
+	return upng->error;
+}
 
-		/* parse chunks */
-		if (upng_chunk_type(chunk) == CHUNK_IDAT) {
-			memcpy(compressed + compressed_index, data, length);
-			compressed_index += length;
-		} else if (upng_chunk_type(chunk) == CHUNK_IEND) {
-			break;
-		}
+/*give back the memory of the decode upng_decode_step is in the middle of, if there is one*/
+static void upng_step_free(upng_t* upng)
+{
+	upng_step* step = upng->step;
 
-		chunk += upng_chunk_length(chunk) + 12;
+	if (step == NULL) {
+		return;
 	}
 
-  // Pebble has only so much free ram, so free source buffer now that we are
-  // done with it.
-  free(upng->source.buffer);
-  upng->source.buffer = NULL;
+	upng_decoding_end(upng, &step->decoding);
+	upng_scanlines_free(upng, &step->rows);
+	upng_dealloc(upng, step);
+	upng->step = NULL;
+}
 
-	/* allocate space to store inflated (but still filtered) data */
-	inflated_size = ((upng->width * (upng->height * upng_get_bpp(upng) + 7)) / 8) + upng->height;
-  APP_LOG(APP_LOG_LEVEL_DEBUG, "inflated_size:%d", inflated_size);
-	inflated = (unsigned char*)malloc(inflated_size);
-	if (inflated == NULL) {
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "FAILED: malloc inflated_size:%d", inflated_size);
-		free(compressed);
-		SET_ERROR(upng, UPNG_ENOMEM);
-		return upng->error;
-	}
+/*read a PNG into the image buffer like upng_decode_progressive without a callback, a slice at a time: each call goes
+  on until about budget more bytes of image data went through and returns UPNG_PENDING, until the image is done and
+  it returns the error, UPNG_EOK if there is none. the first call also reads the chunks and sets up the decode. the
+  source buffer and the settings have to stay as they are meanwhile; upng_reset and upng_free give up the decode*/
+upng_error upng_decode_step(upng_t* upng, unsigned long budget)
+{
+	upng_step* step;
 
-	/* decompress image data */
-  APP_LOG(APP_LOG_LEVEL_DEBUG, "about to decompress");
-	error = uz_inflate(upng, inflated, inflated_size, compressed, compressed_size);
-	if (error != UPNG_EOK) {
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "decompress failed");
-		free(compressed);
-		free(inflated);
+	/* if we have an error state, bail now */
+	if (upng->error != UPNG_EOK) {
 		return upng->error;
 	}
-  APP_LOG(APP_LOG_LEVEL_DEBUG, "decompress success");
 
-	/* free the compressed compressed data */
-	free(compressed);
+	if (upng->state != UPNG_DECODING) {
+		/* parse the main header, if necessary */
+		upng_header(upng);
+		if (upng->error != UPNG_EOK) {
+			return upng->error;
+		}
+
+		/* if the state is not HEADER (meaning we are ready to decode the image), stop now */
+		if (upng->state != UPNG_HEADER) {
+			return upng->error;
+		}
 
-	/* allocate final image buffer */
-	upng->size = (upng->height * upng->width * upng_get_bpp(upng) + 7) / 8;
-	upng->buffer = (unsigned char*)malloc(upng->size);
-	if (upng->buffer == NULL) {
-		free(inflated);
-		upng->size = 0;
-		SET_ERROR(upng, UPNG_ENOMEM);
-		return upng->error;
+		upng_check_output(upng, 0);
+		if (upng->error != UPNG_EOK) {
+			return upng->error;
+		}
+
+		if (!upng_alloc_image(upng)) {
+			return upng->error;
+		}
+
+		step = (upng_step*)upng_alloc(upng, sizeof(upng_step));
+		if (step == NULL) {
+			SET_ERROR(upng, UPNG_ENOMEM);
+			upng_release_image(upng);
+			return upng->error;
+		}
+		upng->step = step;
+		upng->state = UPNG_DECODING;
+
+		upng_scanlines_init(upng, &step->rows);
+		step->rows.image = upng->buffer;
+		upng_decoding_begin(upng, &step->decoding, &step->rows);
 	}
 
-	/* unfilter scanlines */
-	post_process_scanlines(upng, upng->buffer, inflated, upng);
-	free(inflated);
+	if (upng->error == UPNG_EOK && !upng_decoding_run(upng, &upng->step->decoding, budget)) {
+		return UPNG_PENDING;
+	}
+
+	upng_step_free(upng);
 
 	if (upng->error != UPNG_EOK) {
-		free(upng->buffer);
-		upng->buffer = NULL;
-		upng->size = 0;
+		upng_release_image(upng);
+		upng->state = UPNG_HEADER;
 	} else {
 		upng->state = UPNG_DECODED;
 	}
@@ -1164,23 +3987,27 @@ upng_error upng_decode(upng_t* upng)
 	return upng->error;
 }
 
-static upng_t* upng_new(void)
+static void upng_init(upng_t* upng)
 {
-	upng_t* upng;
-
-	upng = (upng_t*)malloc(sizeof(upng_t));
-	if (upng == NULL) {
-		return NULL;
-	}
-
 	upng->buffer = NULL;
 	upng->size = 0;
+	upng->capacity = 0;
 
 	upng->width = upng->height = 0;
 
 	upng->color_type = UPNG_RGBA;
 	upng->color_depth = 8;
 	upng->format = UPNG_RGBA8;
+	upng->output = UPNG_OUTPUT_NATIVE;
+	upng->dither = UPNG_DITHER_DIFFUSION;
+	upng->interlace = 0;
+	upng->in_place = 0;
+	upng->palette = NULL;
+	upng->scale_width = upng->scale_height = 0;
+	upng->background = -1;
+	upng->levels = UPNG_LEVELS_FIXED;
+	upng->cut_gray = 64;
+	upng->cut_white = 192;
 
 	upng->state = UPNG_NEW;
 
@@ -1190,7 +4017,40 @@ static upng_t* upng_new(void)
 	upng->source.buffer = NULL;
 	upng->source.size = 0;
 	upng->source.owning = 0;
+	upng->source.read = NULL;
+	upng->source.user = NULL;
+	upng->source.window = NULL;
+	upng->source.window_offset = upng->source.window_fill = 0;
+
+#ifdef UPNG_TINFL_ONLY
+	upng->inflater = UPNG_INFLATER_TINFL;
+#else
+	upng->inflater = UPNG_INFLATER_BUILTIN;
+#endif
+	upng->verify = UPNG_VERIFY_NONE;
+	upng->crc_table = NULL;
+	upng->idat_count = 0;
+
+	upng->allocator.alloc = upng_heap_alloc;
+	upng->allocator.free = upng_heap_free;
+	upng->allocator.user = NULL;
+	upng->arena = NULL;
+	upng->arena_size = upng->arena_used = upng->arena_last = 0;
+	upng->arena_live = 0;
+
+	upng->step = NULL;
+}
+
+static upng_t* upng_new(void)
+{
+	upng_t* upng;
+
+	upng = (upng_t*)malloc(sizeof(upng_t));
+	if (upng == NULL) {
+		return NULL;
+	}
 
+	upng_init(upng);
 	return upng;
 }
 
@@ -1208,6 +4068,123 @@ upng_t* upng_new_from_bytes(const unsigned char* buffer, unsigned long size)
 	return upng;
 }
 
+/*a decoder for a PNG of size bytes that read fetches a window at a time as the decode needs them, instead of the
+  whole file being in memory; read has to give the bytes asked for unless the PNG ends before*/
+upng_t* upng_new_from_reader(upng_read_callback read, void* user, unsigned long size)
+{
+	upng_t* upng = upng_new();
+	if (upng == NULL) {
+		return NULL;
+	}
+
+	upng->source.window = (unsigned char*)malloc(UPNG_READ_WINDOW);
+	if (upng->source.window == NULL) {
+		free(upng);
+		return NULL;
+	}
+
+	upng->source.size = size;
+	upng->source.read = read;
+	upng->source.user = user;
+
+	return upng;
+}
+
+/*make upng ready to decode another PNG from buffer, keeping the settings and the memory: the image buffer is reused
+  if the next image fits in it, and an arena starts over empty (upng_set_arena grows it if the next image needs more).
+  the image of the last decode is gone. return value is error*/
+upng_error upng_reset(upng_t* upng, const unsigned char* buffer, unsigned long size)
+{
+	upng_step_free(upng);
+	upng_free_source(upng);
+
+	/* an arena is reused as a whole, everything in it goes */
+	if (upng->arena != NULL) {
+		upng_release_image(upng);
+		upng_dealloc(upng, upng->palette);
+		upng->palette = NULL;
+		upng->arena_used = upng->arena_last = 0;
+		upng->arena_live = 0;
+	}
+	upng->size = 0;
+
+	upng->width = upng->height = 0;
+	upng->state = UPNG_NEW;
+	upng->error = UPNG_EOK;
+	upng->error_line = 0;
+	upng->idat_count = 0;
+
+	upng->source.buffer = buffer;
+	upng->source.size = size;
+	upng->source.owning = 0;
+
+	return UPNG_EOK;
+}
+
+/*upng_reset for a PNG that read fetches a window at a time, like upng_new_from_reader. return value is error*/
+upng_error upng_reset_reader(upng_t* upng, upng_read_callback read, void* user, unsigned long size)
+{
+	upng_reset(upng, NULL, size);
+
+	if (upng->source.window == NULL) {
+		upng->source.window = (unsigned char*)malloc(UPNG_READ_WINDOW);
+		if (upng->source.window == NULL) {
+			SET_ERROR(upng, UPNG_ENOMEM);
+			return upng->error;
+		}
+	}
+
+	upng->source.read = read;
+	upng->source.user = user;
+
+	return UPNG_EOK;
+}
+
+/*read the header, and add up the IDAT chunks as far as the chunk list goes in buffer, without allocating anything:
+  the start of a file is enough to plan the memory for decoding it. return value is error*/
+upng_error upng_probe(const unsigned char* buffer, unsigned long size, upng_info* info)
+{
+	upng_t upng;
+	unsigned long offset;
+
+	upng_init(&upng);
+	upng.source.buffer = buffer;
+	upng.source.size = size;
+
+	if (upng_header(&upng) != UPNG_EOK) {
+		return upng.error;
+	}
+
+	info->width = upng.width;
+	info->height = upng.height;
+	info->bitdepth = upng.color_depth;
+	info->format = upng.format;
+	info->interlace = upng.interlace;
+	info->inflated_size = upng_inflated_size(&upng);
+	info->idat_size = 0;
+	info->idat_complete = 0;
+
+	/* only the length and type of each chunk are read, so the walk goes on as long as buffer holds those */
+	for (offset = 33; offset + 8 <= size; ) {
+		unsigned long length = upng_chunk_length(buffer + offset);
+
+		if (length > INT_MAX) {
+			return UPNG_EMALFORMED;
+		}
+
+		if (upng_chunk_type(buffer + offset) == CHUNK_IEND) {
+			info->idat_complete = 1;
+			break;
+		} else if (upng_chunk_type(buffer + offset) == CHUNK_IDAT) {
+			info->idat_size += length;
+		}
+
+		offset += length + 12;
+	}
+
+	return UPNG_EOK;
+}
+
 #if 0
 upng_t* upng_new_from_file(const char *filename)
 {
@@ -1253,18 +4230,244 @@ upng_t* upng_new_from_file(const char *filename)
 
 void upng_free(upng_t* upng)
 {
+	/* give up a decode upng_decode_step is in the middle of */
+	upng_step_free(upng);
+
 	/* deallocate image buffer */
 	if (upng->buffer != NULL) {
-		free(upng->buffer);
+		upng_dealloc(upng, upng->buffer);
 	}
 
 	/* deallocate source buffer, if necessary */
 	upng_free_source(upng);
 
+	upng_dealloc(upng, upng->palette);
+	free(upng->source.window);
+
+	/* give back the arena all at once */
+	if (upng->arena != NULL && upng->allocator.free != NULL) {
+		upng->allocator.free(upng->allocator.user, upng->arena);
+	}
+
 	/* deallocate struct itself */
 	free(upng);
 }
 
+/*choose the inflate implementation used by the next decode; it has to be compiled in*/
+upng_error upng_set_inflater(upng_t* upng, upng_inflater inflater)
+{
+	switch (inflater) {
+#ifndef UPNG_TINFL_ONLY
+	case UPNG_INFLATER_BUILTIN:
+#endif
+#ifdef UPNG_TINFL
+	case UPNG_INFLATER_TINFL:
+#endif
+		upng->inflater = inflater;
+		return UPNG_EOK;
+	default:
+		return UPNG_EPARAM;
+	}
+}
+
+upng_error upng_set_output(upng_t* upng, upng_output output)
+{
+	switch (output) {
+	case UPNG_OUTPUT_NATIVE:
+	case UPNG_OUTPUT_PLANES:
+	case UPNG_OUTPUT_LEVELS:
+		upng->output = output;
+		return UPNG_EOK;
+	default:
+		return UPNG_EPARAM;
+	}
+}
+
+upng_error upng_set_dither(upng_t* upng, upng_dither dither)
+{
+	switch (dither) {
+	case UPNG_DITHER_DIFFUSION:
+	case UPNG_DITHER_ORDERED:
+	case UPNG_DITHER_NONE:
+		upng->dither = dither;
+		return UPNG_EOK;
+	default:
+		return UPNG_EPARAM;
+	}
+}
+
+/*scale the image down while decoding, so it fits into width by height pixels; 0 by 0 turns scaling off*/
+upng_error upng_set_scale(upng_t* upng, unsigned width, unsigned height)
+{
+	if ((width == 0) != (height == 0)) {
+		return UPNG_EPARAM;
+	}
+
+	upng->scale_width = width;
+	upng->scale_height = height;
+	return UPNG_EOK;
+}
+
+/*choose the checksums the next decode verifies*/
+upng_error upng_set_verify(upng_t* upng, upng_verify verify)
+{
+	switch (verify) {
+	case UPNG_VERIFY_NONE:
+	case UPNG_VERIFY_ADLER:
+	case UPNG_VERIFY_FULL:
+		upng->verify = verify;
+		return UPNG_EOK;
+	default:
+		return UPNG_EPARAM;
+	}
+}
+
+/*have upng_decode write the image over the inflated image data instead of into a buffer of its own, where it fits;
+  the buffer then is the size of the inflated data, unless it can be shrunk*/
+upng_error upng_set_in_place(upng_t* upng, int in_place)
+{
+	upng->in_place = in_place != 0;
+	return UPNG_EOK;
+}
+
+/*take memory for decoding from allocator instead of malloc and free; only while nothing is allocated yet*/
+upng_error upng_set_allocator(upng_t* upng, const upng_allocator* allocator)
+{
+	if (upng->arena != NULL || upng->buffer != NULL || upng->palette != NULL || upng->crc_table != NULL) {
+		return UPNG_EPARAM;
+	}
+
+	if (allocator == NULL) {
+		upng->allocator.alloc = upng_heap_alloc;
+		upng->allocator.free = upng_heap_free;
+		upng->allocator.user = NULL;
+	} else if (allocator->alloc == NULL) {
+		return UPNG_EPARAM;
+	} else {
+		upng->allocator = *allocator;
+	}
+	return UPNG_EOK;
+}
+
+/*memory a decode takes at most with the settings made so far, as if everything any of the decode functions allocates
+  were needed at once; the header must have been read*/
+static unsigned long upng_arena_need(const upng_t* upng)
+{
+	unsigned width, height;
+	unsigned long need, delay;
+
+	upng_scaled_size(upng, &width, &height);
+
+	/* the image, and the inflated image data or the window that takes its place */
+	need = upng_arena_round(upng_image_size(upng)) + upng_arena_round(upng_inflated_size(upng));
+	if (upng->verify == UPNG_VERIFY_FULL) {
+		need += upng_arena_round(4 * 256 * sizeof(unsigned));
+	}
+	if (upng->color_type == UPNG_PLT) {
+		need += upng_arena_round(256);
+	}
+#ifdef UPNG_TINFL
+	if (upng->inflater == UPNG_INFLATER_TINFL) {
+		need += upng_arena_round(sizeof(tinfl_decompressor));
+	}
+#endif
+#ifndef UPNG_TINFL_ONLY
+	if (upng->inflater == UPNG_INFLATER_BUILTIN) {
+		need += upng_arena_round(sizeof(uz_trees));
+	}
+#endif
+
+	/* what upng_decode_step carries between calls, and the scanline buffers */
+	need += upng_arena_round(sizeof(upng_step));
+	need += upng_arena_round(2 * ((upng->width * upng_source_bpp(upng) + 7) / 8 + 1));
+	if (width != upng->width || height != upng->height) {
+		need += upng_arena_round(width * upng_get_components(upng) * sizeof(unsigned long));
+	}
+	if (upng_composited(upng)) {
+		need += upng_arena_round((upng->width * upng->color_depth + 7) / 8);
+	}
+	if (upng->output != UPNG_OUTPUT_NATIVE) {
+		need += upng_arena_round((width * 2 + 7) / 8) + upng_arena_round((width + 2) * sizeof(short));
+		if (upng->levels != UPNG_LEVELS_FIXED && upng->color_depth > 2) {
+			delay = width != 0 && width < UPNG_LEVELS_DELAY ? UPNG_LEVELS_DELAY / width * width : width;
+			if (upng->interlace && delay < adam7_count(upng->width, 0, 8) * adam7_count(upng->height, 0, 8)) {
+				delay = adam7_count(upng->width, 0, 8) * adam7_count(upng->height, 0, 8);
+			}
+			need += upng_arena_round(64 * sizeof(unsigned long)) + upng_arena_round(delay) + upng_arena_round(256);
+		}
+	}
+
+	return need;
+}
+
+/*take all memory for decoding out of a single block of size bytes, allocated now and given back by upng_free. size 0
+  reads the header and allocates what the settings made so far need at most, so set those first. after upng_reset an
+  arena that is large enough is kept, a smaller one is replaced, so switching between images settles on the largest*/
+upng_error upng_set_arena(upng_t* upng, unsigned long size)
+{
+	/* only before decoding, or after upng_reset when nothing of the last image is needed anymore */
+	if (upng->size != 0 || upng->crc_table != NULL || (upng->arena != NULL && upng->arena_live != 0)) {
+		return UPNG_EPARAM;
+	}
+
+	if (size == 0) {
+		if (upng_header(upng) != UPNG_EOK) {
+			return upng->error;
+		}
+		size = upng_arena_need(upng);
+	}
+
+	if (upng->arena != NULL) {
+		if (size <= upng->arena_size) {
+			return UPNG_EOK;
+		}
+		if (upng->allocator.free != NULL) {
+			upng->allocator.free(upng->allocator.user, upng->arena);
+		}
+		upng->arena = NULL;
+		upng->arena_size = 0;
+	}
+
+	/* what upng_reset kept on the heap is not needed with an arena */
+	upng_release_image(upng);
+	upng_dealloc(upng, upng->palette);
+	upng->palette = NULL;
+
+	upng->arena = (unsigned char*)upng->allocator.alloc(upng->allocator.user, size);
+	if (upng->arena == NULL) {
+		return UPNG_ENOMEM;
+	}
+	upng->arena_size = size;
+	upng->arena_used = upng->arena_last = 0;
+	upng->arena_live = 0;
+	return UPNG_EOK;
+}
+
+/*composite alpha against a background luma of 0 to 255 while decoding, so images with alpha come out as a single gray
+  channel; -1 keeps the alpha channel*/
+upng_error upng_set_background(upng_t* upng, int luma)
+{
+	if (luma < -1 || luma > 255) {
+		return UPNG_EPARAM;
+	}
+
+	upng->background = luma;
+	return UPNG_EOK;
+}
+
+upng_error upng_set_levels(upng_t* upng, upng_levels levels)
+{
+	switch (levels) {
+	case UPNG_LEVELS_FIXED:
+	case UPNG_LEVELS_OTSU:
+	case UPNG_LEVELS_PERCENTILE:
+		upng->levels = levels;
+		return UPNG_EOK;
+	default:
+		return UPNG_EPARAM;
+	}
+}
+
 upng_error upng_get_error(const upng_t* upng)
 {
 	return upng->error;
@@ -1277,12 +4480,18 @@ unsigned upng_get_error_line(const upng_t* upng)
 
 unsigned upng_get_width(const upng_t* upng)
 {
-	return upng->width;
+	unsigned width, height;
+
+	upng_scaled_size(upng, &width, &height);
+	return width;
 }
 
 unsigned upng_get_height(const upng_t* upng)
 {
-	return upng->height;
+	unsigned width, height;
+
+	upng_scaled_size(upng, &width, &height);
+	return height;
 }
 
 unsigned upng_get_bpp(const upng_t* upng)
@@ -1292,18 +4501,10 @@ unsigned upng_get_bpp(const upng_t* upng)
 
 unsigned upng_get_components(const upng_t* upng)
 {
-	switch (upng->color_type) {
-	case UPNG_LUM:
+	if (upng_composited(upng)) {
 		return 1;
-	case UPNG_RGB:
-		return 3;
-	case UPNG_LUMA:
-		return 2;
-	case UPNG_RGBA:
-		return 4;
-	default:
-		return 0;
 	}
+	return upng_source_components(upng);
 }
 
 unsigned upng_get_bitdepth(const upng_t* upng)
@@ -1320,9 +4521,18 @@ unsigned upng_get_pixelsize(const upng_t* upng)
 
 upng_format upng_get_format(const upng_t* upng)
 {
+	if (upng_composited(upng) && upng->format != UPNG_BADFORMAT) {
+		return luminance_format(upng->color_depth);
+	}
 	return upng->format;
 }
 
+void upng_get_cuts(const upng_t* upng, unsigned* gray, unsigned* white)
+{
+	*gray = upng->cut_gray;
+	*white = upng->cut_white;
+}
+
 const unsigned char* upng_get_buffer(const upng_t* upng)
 {
 	return upng->buffer;
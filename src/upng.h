@@ -34,9 +34,11 @@ typedef enum upng_error {
 	UPNG_ENOTPNG		= 3, /* image data does not have a PNG header */
 	UPNG_EMALFORMED		= 4, /* image data is not a valid PNG image */
 	UPNG_EUNSUPPORTED	= 5, /* critical PNG chunk type is not supported */
-	UPNG_EUNINTERLACED	= 6, /* image interlacing is not supported */
+	UPNG_EUNINTERLACED	= 6, /* image interlacing is not supported (by upng_decode_rows) */
 	UPNG_EUNFORMAT		= 7, /* image color format is not supported */
-	UPNG_EPARAM			= 8  /* invalid parameter to method call */
+	UPNG_EPARAM			= 8, /* invalid parameter to method call */
+	UPNG_ECHECKSUM		= 9, /* a chunk CRC or the zlib Adler-32 does not match the data */
+	UPNG_PENDING		= 10 /* not an error: upng_decode_step has more to do, call it again */
 } upng_error;
 
 typedef enum upng_format {
@@ -52,17 +54,102 @@ typedef enum upng_format {
 	UPNG_LUMINANCE_ALPHA1,
 	UPNG_LUMINANCE_ALPHA2,
 	UPNG_LUMINANCE_ALPHA4,
-	UPNG_LUMINANCE_ALPHA8
+	UPNG_LUMINANCE_ALPHA8,
+	UPNG_LUMINANCE16,
+	UPNG_LUMINANCE_ALPHA16
 } upng_format;
 
+typedef enum upng_inflater {
+	UPNG_INFLATER_BUILTIN,	/* uPNG's own inflater */
+	UPNG_INFLATER_TINFL		/* miniz's tinfl, needs UPNG_TINFL */
+} upng_inflater;
+
+typedef enum upng_output {
+	UPNG_OUTPUT_NATIVE,		/* pixels in the image's own format, rows not padded */
+	UPNG_OUTPUT_PLANES,		/* a white and a gray bit plane in framebuffer order */
+	UPNG_OUTPUT_LEVELS		/* black, gray and white as 2 bit luminance values 0, 2 and 3 */
+} upng_output;
+
+/* how images of more than 2 bits are brought down to black, gray and white for UPNG_OUTPUT_PLANES and UPNG_OUTPUT_LEVELS */
+typedef enum upng_dither {
+	UPNG_DITHER_DIFFUSION,	/* Floyd-Steinberg error diffusion; ordered for interlaced images */
+	UPNG_DITHER_ORDERED,	/* 4x4 Bayer matrix */
+	UPNG_DITHER_NONE		/* nearest level */
+} upng_dither;
+
+/* which checksums are verified while decoding */
+typedef enum upng_verify {
+	UPNG_VERIFY_NONE,		/* none, for trusted images such as resources built into the app */
+	UPNG_VERIFY_ADLER,		/* the Adler-32 of the inflated image data */
+	UPNG_VERIFY_FULL		/* the Adler-32 and the CRC of every chunk */
+} upng_verify;
+
+/* where the cut points between black, gray and white go for images of more than 2 bits; the automatic ones are picked
+   from the first scanlines of the image (the first Adam7 pass of interlaced images) while they are decoded */
+typedef enum upng_levels {
+	UPNG_LEVELS_FIXED,		/* gray from luma 64 on, white from 192 on */
+	UPNG_LEVELS_OTSU,		/* Otsu's method: the cut points that best split the histogram in three */
+	UPNG_LEVELS_PERCENTILE	/* the fixed cut points, stretched over the lumas between the darkest and lightest 1% */
+} upng_levels;
+
+/* bytes per row of a bit plane, as in the framebuffer; the white plane is height rows, followed by the gray plane */
+#define UPNG_PLANE_STRIDE 20
+
 typedef struct upng_t upng_t;
 
-upng_t*		upng_new_from_bytes	(const unsigned char* buffer, unsigned long size);
+/* where a decoder gets its memory; free may be NULL for pools that are given back all at once */
+typedef struct upng_allocator {
+	void*	(*alloc)(void* user, unsigned long size);
+	void	(*free)(void* user, void* ptr);
+	void*	user;
+} upng_allocator;
+
+/* what upng_probe reads from the start of a file */
+typedef struct upng_info {
+	unsigned		width;
+	unsigned		height;
+	unsigned		bitdepth;
+	upng_format		format;			/* of the image in the file, before any output settings */
+	unsigned		interlace;		/* 1 for Adam7 */
+	unsigned long	inflated_size;	/* bytes the image data inflates to, filter type bytes included */
+	unsigned long	idat_size;		/* bytes of compressed image data in the IDAT chunks found */
+	int				idat_complete;	/* nonzero if IEND was found too, so idat_size is all of it */
+} upng_info;
+
+/* reads size bytes of the PNG, from offset on, into buffer; return value is the number of bytes read */
+typedef unsigned long (*upng_read_callback)(void* user, unsigned long offset, unsigned char* buffer, unsigned long size);
+
+/* receives one unfiltered (or scaled) scanline of length bytes, in the image's own format, for each row y; row is only valid during the call */
+typedef void (*upng_row_callback)(void* user, unsigned y, const unsigned char* row, unsigned long length);
+
+/* called when Adam7 pass (0 to 6) is done and the image buffer holds a preview of the image; done is nonzero after the last pass */
+typedef void (*upng_pass_callback)(void* user, unsigned pass, int done);
+
+upng_t*		upng_new_from_bytes	(const unsigned char* buffer, unsigned long size);	/* buffer stays the caller's, and has to last until the decode is done */
+upng_t*		upng_new_from_reader	(upng_read_callback read, void* user, unsigned long size);	/* size is that of the whole PNG */
+upng_error	upng_probe			(const unsigned char* buffer, unsigned long size, upng_info* info);	/* buffer may hold just the start of the file */
+upng_error	upng_reset			(upng_t* upng, const unsigned char* buffer, unsigned long size);	/* decode another PNG, keeping settings and memory */
+upng_error	upng_reset_reader	(upng_t* upng, upng_read_callback read, void* user, unsigned long size);
 //upng_t*		upng_new_from_file	(const char* path);
 void		upng_free			(upng_t* upng);
 
+upng_error	upng_set_inflater	(upng_t* upng, upng_inflater inflater);
+upng_error	upng_set_output		(upng_t* upng, upng_output output);
+upng_error	upng_set_dither		(upng_t* upng, upng_dither dither);
+upng_error	upng_set_scale		(upng_t* upng, unsigned width, unsigned height);	/* width and height of the image then are the scaled ones */
+upng_error	upng_set_levels		(upng_t* upng, upng_levels levels);
+upng_error	upng_set_verify		(upng_t* upng, upng_verify verify);
+upng_error	upng_set_in_place	(upng_t* upng, int in_place);	/* upng_decode only, for images that are not interlaced nor bit planes */
+upng_error	upng_set_background	(upng_t* upng, int luma);	/* format, bpp and components of images with alpha then are those of the gray output */
+upng_error	upng_set_allocator	(upng_t* upng, const upng_allocator* allocator);	/* NULL for malloc and free */
+upng_error	upng_set_arena		(upng_t* upng, unsigned long size);	/* 0 for the size the header and the settings so far need */
+
 upng_error	upng_header			(upng_t* upng);
 upng_error	upng_decode			(upng_t* upng);
+upng_error	upng_decode_rows	(upng_t* upng, upng_row_callback callback, void* user);
+upng_error	upng_decode_progressive	(upng_t* upng, upng_pass_callback callback, void* user);
+upng_error	upng_decode_into	(upng_t* upng, unsigned char* dst, unsigned long stride, upng_output output);	/* rows stride bytes apart, bit planes one after the other */
+upng_error	upng_decode_step	(upng_t* upng, unsigned long budget);	/* UPNG_PENDING until the image is done, about budget bytes of image data per call */
 
 upng_error	upng_get_error		(const upng_t* upng);
 unsigned	upng_get_error_line	(const upng_t* upng);
@@ -74,6 +161,7 @@ unsigned	upng_get_bitdepth	(const upng_t* upng);
 unsigned	upng_get_components	(const upng_t* upng);
 unsigned	upng_get_pixelsize	(const upng_t* upng);
 upng_format	upng_get_format		(const upng_t* upng);
+void		upng_get_cuts		(const upng_t* upng, unsigned* gray, unsigned* white);	/* lumas the last decode turned gray and white from */
 
 const unsigned char*	upng_get_buffer		(const upng_t* upng);
 unsigned				upng_get_size		(const upng_t* upng);